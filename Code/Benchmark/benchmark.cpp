@@ -0,0 +1,165 @@
+/*
+	Benchmark of the simulation. Runs the four scenarios of main.cpp at several grid sizes and thread counts, and
+	writes steps per second, cells per second, ie. events per second, and the scaling efficiency as JSON.
+
+	Timers slow the simulation down, so the Benchmark project is built without them. The BenchmarkProfile project
+	is the same program built with DUNE_PROFILE, which also writes the time spent in every phase.
+
+	Usage: Benchmark [-steps n] [-sizes 256,512] [-threads 1,2,4] [-o results.json]
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "desert.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Scenario of the benchmark, see main.cpp.
+struct Scenario
+{
+	const char* name;		//!< Name.
+	float rMin, rMax;		//!< Initial amount of sediment per cell.
+	Vector2 wind;			//!< Base wind.
+	bool abrasion;			//!< Abrasion mode.
+	bool vegetation;		//!< Vegetation mode.
+};
+
+// Result of a run.
+struct Measure
+{
+	double seconds;					//!< Time of the timed steps.
+	double phases[PhaseCount];		//!< Time spent in every phase, summed over the threads.
+};
+
+static const Scenario scenarios[4] =
+{
+	{ "transverse", 3.0f, 5.0f, Vector2(0, 3), false, false },
+	{ "barchan", 0.5f, 2.0f, Vector2(0, 5), false, false },
+	{ "yardangs", 0.5f, 0.5f, Vector2(0, 6), true, false },
+	{ "nabkha", 2.0f, 5.0f, Vector2(0, 3), false, true },
+};
+#if DUNE_PROFILE
+static const char* phaseNames[PhaseCount] = { "lift", "saltation", "shadow", "reptation", "abrasion", "stabilization", "bedrock_stabilization", "relaxation" };
+#endif
+
+/*!
+\brief Parse a comma separated list of integers.
+\param s list
+*/
+static std::vector<int> ParseList(const char* s)
+{
+	std::vector<int> list;
+	while (*s != 0)
+	{
+		char* end;
+		const long v = strtol(s, &end, 10);
+		if (end == s)
+			break;
+		if (v > 0)
+			list.push_back(int(v));
+		s = *end == ',' ? end + 1 : end;
+	}
+	return list;
+}
+
+/*!
+\brief Run a scenario and time its steps, after a first untimed step.
+\param scenario scenario
+\param size grid resolution, cells are 1 meter wide
+\param threads number of threads
+\param steps number of timed steps
+*/
+static Measure Run(const Scenario& scenario, int size, int threads, int steps)
+{
+	DuneSediment dune(Box2D(Vector2(0), Vector2(float(size))), size, size, scenario.rMin, scenario.rMax, scenario.wind);
+	dune.SetAbrasionMode(scenario.abrasion);
+	dune.SetVegetationMode(scenario.vegetation);
+	dune.SetThreadCount(threads);
+	dune.SimulationStepMultiThreadAtomic();
+	dune.ResetPhaseTimes();
+
+	Measure m;
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < steps; i++)
+		dune.SimulationStepMultiThreadAtomic();
+	m.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	dune.PhaseTimes(m.phases);
+	return m;
+}
+
+/*!
+\brief Run the benchmark.
+*/
+int main(int argc, char** argv)
+{
+	int steps = 20;
+	std::vector<int> sizes = { 256, 512 };
+	std::vector<int> threads;
+	for (int t = 1; t < omp_get_max_threads(); t *= 2)
+		threads.push_back(t);
+	threads.push_back(omp_get_max_threads());
+	const char* url = nullptr;
+	for (int a = 1; a + 1 < argc; a += 2)
+	{
+		if (strcmp(argv[a], "-steps") == 0)
+			steps = Math::Max(1, atoi(argv[a + 1]));
+		else if (strcmp(argv[a], "-sizes") == 0)
+			sizes = ParseList(argv[a + 1]);
+		else if (strcmp(argv[a], "-threads") == 0)
+			threads = ParseList(argv[a + 1]);
+		else if (strcmp(argv[a], "-o") == 0)
+			url = argv[a + 1];
+	}
+	if (sizes.empty() || threads.empty())
+	{
+		fprintf(stderr, "Usage: Benchmark [-steps n] [-sizes 256,512] [-threads 1,2,4] [-o results.json]\n");
+		return 1;
+	}
+	FILE* out = url != nullptr ? fopen(url, "w") : stdout;
+	if (out == nullptr)
+	{
+		fprintf(stderr, "Cannot open %s\n", url);
+		return 1;
+	}
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"config\": { \"steps\": %d, \"profile\": %d, \"tiled_fields\": %d, \"interleaved_terrain\": %d, \"max_threads\": %d },\n",
+		steps, DUNE_PROFILE, SCALAR_FIELD_TILED, TERRAIN_INTERLEAVED, omp_get_max_threads());
+	fprintf(out, "  \"runs\": [");
+	bool first = true;
+	for (int s = 0; s < 4; s++)
+	{
+		for (int n = 0; n < sizes.size(); n++)
+		{
+			// Efficiency is relative to the first thread count
+			double reference = 0.0;
+			for (int t = 0; t < threads.size(); t++)
+			{
+				fprintf(stderr, "%s %dx%d, %d threads\n", scenarios[s].name, sizes[n], sizes[n], threads[t]);
+				const Measure m = Run(scenarios[s], sizes[n], threads[t], steps);
+				if (t == 0)
+					reference = m.seconds * threads[t];
+				const double stepsPerSecond = steps / m.seconds;
+				const double cellsPerSecond = stepsPerSecond * double(sizes[n]) * double(sizes[n]);
+
+				fprintf(out, "%s\n    { \"scenario\": \"%s\", \"size\": %d, \"threads\": %d, \"seconds\": %.6f, \"steps_per_second\": %.4f, \"cells_per_second\": %.1f, \"efficiency\": %.4f",
+					first ? "" : ",", scenarios[s].name, sizes[n], threads[t], m.seconds, stepsPerSecond, cellsPerSecond, reference / (m.seconds * threads[t]));
+#if DUNE_PROFILE
+				fprintf(out, ",\n      \"phases\": {");
+				for (int p = 0; p < PhaseCount; p++)
+					fprintf(out, "%s \"%s\": %.6f", p == 0 ? "" : ",", phaseNames[p], m.phases[p]);
+				fprintf(out, " }");
+#endif
+				fprintf(out, " }");
+				first = false;
+			}
+		}
+	}
+	fprintf(out, "\n  ]\n}\n");
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
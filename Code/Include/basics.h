@@ -2,9 +2,78 @@
 #include "vec.h"
 #include <time.h>
 
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
 #include <vector>
 
-// Random (Dirty, C-style)
+// Counter-based random number generator. Each value is a hash of (key, counter), so streams are cheap to create
+// and reseed, and two streams with different keys are independent.
+class RandomStream
+{
+protected:
+	uint64_t key;		//!< Stream key, derived from the seed and the stream index.
+	uint64_t counter;	//!< Number of values drawn so far.
+
+public:
+	/*!
+	\brief Constructor.
+	\param seed run seed
+	\param stream stream index, typically a thread or an event index
+	*/
+	explicit RandomStream(uint64_t seed = 0, uint64_t stream = 0) : key(Mix(seed ^ Mix(stream + 0x632BE59BD9B4E019ull))), counter(0)
+	{
+		// Empty
+	}
+
+	/*!
+	\brief SplitMix64 finalizer, used as the counter hash.
+	*/
+	static inline uint64_t Mix(uint64_t z)
+	{
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	/*!
+	\brief Compute the next 64 bits random value of the stream.
+	*/
+	inline uint64_t Next()
+	{
+		return Mix(key + (++counter) * 0x9E3779B97F4A7C15ull);
+	}
+
+	/*!
+	\brief Compute a uniform random number in [0, 1).
+	*/
+	inline float Uniform()
+	{
+		return float(Next() >> 40) * (1.0f / 16777216.0f);
+	}
+
+	/*!
+	\brief Compute a uniform random number in [0, 1), with double precision.
+	*/
+	inline double UniformDouble()
+	{
+		return double(Next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	/*!
+	\brief Compute a random positive integer.
+	*/
+	inline int Integer()
+	{
+		return int(Next() >> 33);
+	}
+};
+
+// Random. Static interface over a thread local RandomStream, so that threads never share generator state.
 class Random
 {
 public:
@@ -16,6 +85,26 @@ public:
 		// Empty
 	}
 
+	/*!
+	\brief Reset the stream of the calling thread.
+	\param seed run seed
+	\param stream stream index
+	*/
+	static inline void Seed(uint64_t seed, uint64_t stream)
+	{
+		Stream() = RandomStream(seed, stream);
+	}
+
+	/*!
+	\brief Returns the stream of the calling thread. Threads that never called Seed() get distinct default streams.
+	*/
+	static inline RandomStream& Stream()
+	{
+		static std::atomic<uint64_t> nextStream(0);
+		static thread_local RandomStream stream(0, nextStream++);
+		return stream;
+	}
+
 	/*!
 	\brief Compute a random number in a given range.
 	\param a min
@@ -27,11 +116,19 @@ public:
 	}
 
 	/*!
-	\brief Compute a uniform random number in [0, 1]
+	\brief Compute a uniform random number in [0, 1)
 	*/
 	static inline float Uniform()
 	{
-		return float(rand()) / RAND_MAX;
+		return Stream().Uniform();
+	}
+
+	/*!
+	\brief Compute a uniform random number in [0, 1), with double precision.
+	*/
+	static inline double UniformDouble()
+	{
+		return Stream().UniformDouble();
 	}
 
 	/*!
@@ -39,7 +136,7 @@ public:
 	*/
 	static inline int Integer()
 	{
-		return rand();
+		return Stream().Integer();
 	}
 };
 
@@ -178,22 +275,431 @@ inline Vector2 Box2D::operator[](int i) const
 	return b;
 }
 
+// CompensatedSum. Sum of Neumaier, carrying the rounding error of every addition so that the error of the
+// result does not grow with the number of terms.
+class CompensatedSum
+{
+protected:
+	double sum;				//!< Running sum.
+	double compensation;	//!< Accumulated rounding errors.
+
+public:
+	/*!
+	\brief Constructor, the sum is zero.
+	*/
+	inline CompensatedSum() : sum(0.0), compensation(0.0)
+	{
+	}
+
+	/*!
+	\brief Add a term to the sum.
+	\param v term
+	*/
+	inline void Add(double v)
+	{
+		const double t = sum + v;
+		if (fabs(sum) >= fabs(v))
+			compensation += (sum - t) + v;
+		else
+			compensation += (v - t) + sum;
+		sum = t;
+	}
+
+	/*!
+	\brief Add another sum, with its compensation.
+	\param s sum
+	*/
+	inline void Add(const CompensatedSum& s)
+	{
+		Add(s.sum);
+		compensation += s.compensation;
+	}
+
+	/*!
+	\brief Returns the compensated value of the sum.
+	*/
+	inline double Value() const
+	{
+		return sum + compensation;
+	}
+};
+
+// FenwickTree. Binary indexed tree of non negative weights, with logarithmic updates and weighted sampling.
+class FenwickTree
+{
+protected:
+	std::vector<double> tree;	//!< Partial sums, one based.
+	int top;					//!< Largest power of two not greater than the number of weights.
+
+public:
+	/*!
+	\brief Constructor, the tree is empty.
+	*/
+	inline FenwickTree() : top(0)
+	{
+	}
+
+	/*!
+	\brief Build the tree from a set of weights, in linear time.
+	\param weights weights
+	\param n number of weights
+	*/
+	inline void Build(const float* weights, int n)
+	{
+		tree.assign(n + 1, 0.0);
+		for (int k = 1; k <= n; k++)
+		{
+			tree[k] += weights[k - 1];
+			const int parent = k + (k & -k);
+			if (parent <= n)
+				tree[parent] += tree[k];
+		}
+		top = 1;
+		while (2 * top <= n)
+			top *= 2;
+	}
+
+	/*!
+	\brief Add a value to a weight.
+	\param k weight index
+	\param v value
+	*/
+	inline void Add(int k, double v)
+	{
+		for (k++; k < int(tree.size()); k += k & -k)
+			tree[k] += v;
+	}
+
+	/*!
+	\brief Returns the sum of the weights.
+	*/
+	inline double Total() const
+	{
+		double s = 0.0;
+		for (int k = int(tree.size()) - 1; k > 0; k -= k & -k)
+			s += tree[k];
+		return s;
+	}
+
+	/*!
+	\brief Returns the index of the weight containing a position in [0, Total()), ie. the first weight
+	whose prefix sum exceeds the position. Weights are thus sampled with a probability proportional to their value.
+	\param u position
+	*/
+	inline int Find(double u) const
+	{
+		const int n = int(tree.size()) - 1;
+		int k = 0;
+		for (int step = top; step > 0; step /= 2)
+		{
+			if (k + step <= n && tree[k + step] <= u)
+			{
+				k += step;
+				u -= tree[k];
+			}
+		}
+		return k < n ? k : n - 1;
+	}
+};
+
+// AlignedAllocator. Allocator for std::vector returning storage aligned on a given boundary, 64 bytes by default
+// so that arrays start on a cache line.
+template<typename T, size_t Alignment = 64>
+class AlignedAllocator
+{
+public:
+	typedef T value_type;
+	template<typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+	inline AlignedAllocator() { }
+	template<typename U> inline AlignedAllocator(const AlignedAllocator<U, Alignment>&) { }
+
+	/*!
+	\brief Allocate storage for n elements. The address returned by malloc is stored just before the aligned block.
+	\param n number of elements
+	*/
+	inline T* allocate(size_t n)
+	{
+		void* raw = malloc(n * sizeof(T) + Alignment + sizeof(void*));
+		if (raw == nullptr)
+			throw std::bad_alloc();
+		uintptr_t aligned = (uintptr_t(raw) + sizeof(void*) + Alignment - 1) & ~uintptr_t(Alignment - 1);
+		reinterpret_cast<void**>(aligned)[-1] = raw;
+		return reinterpret_cast<T*>(aligned);
+	}
+
+	/*!
+	\brief Release storage returned by allocate().
+	\param p storage
+	*/
+	inline void deallocate(T* p, size_t)
+	{
+		if (p != nullptr)
+			free(reinterpret_cast<void**>(p)[-1]);
+	}
+
+	/*!
+	\brief Construct an element in place. Without arguments, the element is default initialized: arithmetic values
+	are left uninitialized, so that the pages of a new array are first touched by the code writing its values.
+	*/
+	template<typename U> inline void construct(U* p)
+	{
+		::new((void*)p) U;
+	}
+	template<typename U, typename... Args> inline void construct(U* p, Args&&... args)
+	{
+		::new((void*)p) U(std::forward<Args>(args)...);
+	}
+
+	template<typename U> inline bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+	template<typename U> inline bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+
+// CellQueue. FIFO of grid cells stored in a ring buffer, which ignores cells that are already queued.
+// Storage only grows when the capacity is exceeded, so a queue reused across calls does not allocate in steady state.
+class CellQueue
+{
+protected:
+	std::vector<Vector2i> ring;		//!< Queued cells, power of two size.
+	std::vector<Vector2i> set;		//!< Open addressing set of the queued cells, twice the size of the ring.
+	int head;						//!< Index of the first cell in the ring.
+	int count;						//!< Number of queued cells.
+
+	/*!
+	\brief Compute the slot of a cell in the set.
+	*/
+	inline int Hash(const Vector2i& p) const
+	{
+		uint32_t h = uint32_t(p.x) * 0x9E3779B1u ^ uint32_t(p.y) * 0x85EBCA77u;
+		return int((h ^ (h >> 15)) & uint32_t(set.size() - 1));
+	}
+
+	/*!
+	\brief Find the slot of a cell, or the empty slot where it should be inserted.
+	*/
+	inline int Find(const Vector2i& p) const
+	{
+		const int mask = int(set.size()) - 1;
+		int s = Hash(p);
+		while (set[s].x != -1 && (set[s].x != p.x || set[s].y != p.y))
+			s = (s + 1) & mask;
+		return s;
+	}
+
+	/*!
+	\brief Remove a cell from the set, shifting back the following entries of its cluster.
+	*/
+	inline void Erase(const Vector2i& p)
+	{
+		const int mask = int(set.size()) - 1;
+		int hole = Find(p);
+		int s = hole;
+		while (true)
+		{
+			s = (s + 1) & mask;
+			if (set[s].x == -1)
+				break;
+			int h = Hash(set[s]);
+			// Entry can fill the hole if its home slot is not in ]hole, s]
+			if (((s - h) & mask) >= ((s - hole) & mask))
+			{
+				set[hole] = set[s];
+				hole = s;
+			}
+		}
+		set[hole] = Vector2i(-1);
+	}
+
+	/*!
+	\brief Double the capacity of the queue.
+	*/
+	inline void Grow()
+	{
+		std::vector<Vector2i> cells(ring.size() * 2);
+		for (int k = 0; k < count; k++)
+			cells[k] = ring[(head + k) & (ring.size() - 1)];
+		ring.swap(cells);
+		head = 0;
+		set.assign(ring.size() * 2, Vector2i(-1));
+		for (int k = 0; k < count; k++)
+			set[Find(ring[k])] = ring[k];
+	}
+
+public:
+	/*!
+	\brief Constructor.
+	\param capacity initial capacity, rounded up to a power of two
+	*/
+	explicit CellQueue(int capacity = 256) : head(0), count(0)
+	{
+		int n = 1;
+		while (n < capacity)
+			n *= 2;
+		ring.resize(n);
+		set.resize(2 * n, Vector2i(-1));
+	}
+
+	/*!
+	\brief Check if the queue is empty.
+	*/
+	inline bool Empty() const
+	{
+		return count == 0;
+	}
+
+	/*!
+	\brief Returns the number of queued cells.
+	*/
+	inline int Size() const
+	{
+		return count;
+	}
+
+	/*!
+	\brief Append a cell at the end of the queue, unless it is already queued.
+	\param p cell
+	\returns true if the cell was added.
+	*/
+	inline bool Push(const Vector2i& p)
+	{
+		int s = Find(p);
+		if (set[s].x != -1)
+			return false;
+		if (count == int(ring.size()))
+		{
+			Grow();
+			s = Find(p);
+		}
+		set[s] = p;
+		ring[(head + count) & (ring.size() - 1)] = p;
+		count++;
+		return true;
+	}
+
+	/*!
+	\brief Returns the first cell of the queue.
+	*/
+	inline Vector2i Front() const
+	{
+		return ring[head];
+	}
+
+	/*!
+	\brief Remove and return the first cell of the queue.
+	*/
+	inline Vector2i Pop()
+	{
+		Vector2i p = ring[head];
+		head = (head + 1) & (int(ring.size()) - 1);
+		count--;
+		Erase(p);
+		return p;
+	}
+
+	/*!
+	\brief Remove all cells from the queue.
+	*/
+	inline void Clear()
+	{
+		while (count > 0)
+			Pop();
+	}
+};
+
+// FileMapping. Shared read-write mapping of the beginning of a file in memory, see mapping.cpp. Pages are loaded
+// on demand and written back by the system, so mapped data may be larger than the physical memory.
+class FileMapping
+{
+protected:
+	std::string url;			//!< Mapped file.
+	char* address;				//!< Start of the mapping, nullptr if closed.
+	size_t length;				//!< Mapped length in bytes.
+#if defined(_WIN32)
+	void* file;					//!< File handle.
+	void* mapping;				//!< File mapping handle.
+#else
+	int file;					//!< File descriptor.
+#endif
+
+public:
+	FileMapping();
+	~FileMapping();
+	FileMapping(const FileMapping&) = delete;
+	FileMapping& operator=(const FileMapping&) = delete;
+
+	bool Open(const std::string& url, size_t length);
+	void Close();
+	bool Flush();
+
+	/*!
+	\brief Returns the start of the mapping.
+	*/
+	inline char* Address() const
+	{
+		return address;
+	}
+
+	/*!
+	\brief Returns the mapped length in bytes.
+	*/
+	inline size_t Length() const
+	{
+		return length;
+	}
+
+	/*!
+	\brief Returns the path of the mapped file.
+	*/
+	inline const std::string& Url() const
+	{
+		return url;
+	}
+};
+
+// Memory layout of ScalarField2D. By default values are stored row by row. When tiled, values are stored
+// by tiles of 8x8 cells, themselves stored row by row, so that the neighbourhood of a cell spans a few
+// cache lines on large grids. The grid is then padded to a multiple of the tile size.
+#ifndef SCALAR_FIELD_TILED
+#define SCALAR_FIELD_TILED 0
+#endif
 
 // ScalarField2D. Represents a 2D field (nx * ny) of scalar values bounded in world space. Can represent a heightfield.
+// The first grid coordinate i follows the world x axis, the second one j the world y axis.
 class ScalarField2D
 {
 protected:
 	Box2D box;
 	int nx, ny;
-	std::vector<float> values;
+#if SCALAR_FIELD_TILED
+	int tilesX;			//!< Number of tiles along the x axis.
+#endif
+	std::vector<float, AlignedAllocator<float>> values;	//!< Heap storage, empty if the field is mapped.
+	float* data;						//!< Stored values, in values or in a mapped file.
+	int count;							//!< Number of stored values.
+	std::shared_ptr<FileMapping> file;	//!< Mapped file holding the values, if any.
 
 public:
+	/*!
+	\brief Compute the number of values stored for a given resolution, including padding.
+	*/
+	static inline size_t StorageSize(int nx, int ny)
+	{
+#if SCALAR_FIELD_TILED
+		return size_t((nx + 7) >> 3) * size_t((ny + 7) >> 3) * 64;
+#else
+		return size_t(nx) * size_t(ny);
+#endif
+	}
+
 	/*
 	\brief Default Constructor
 	*/
-	inline ScalarField2D() : nx(0), ny(0)
+	inline ScalarField2D() : nx(0), ny(0), data(nullptr), count(0)
 	{
-		// Empty
+#if SCALAR_FIELD_TILED
+		tilesX = 0;
+#endif
 	}
 
 	/*
@@ -204,7 +710,12 @@ public:
 	*/
 	inline ScalarField2D(int nx, int ny, const Box2D& bbox) : box(bbox), nx(nx), ny(ny)
 	{
-		values.resize(size_t(nx * ny));
+#if SCALAR_FIELD_TILED
+		tilesX = (nx + 7) >> 3;
+#endif
+		values.resize(StorageSize(nx, ny), 0.0f);
+		data = values.data();
+		count = int(values.size());
 	}
 
 	/*
@@ -216,18 +727,95 @@ public:
 	*/
 	inline ScalarField2D(int nx, int ny, const Box2D& bbox, float value) : box(bbox), nx(nx), ny(ny)
 	{
-		values.resize(size_t(nx * ny));
-		Fill(value);
+#if SCALAR_FIELD_TILED
+		tilesX = (nx + 7) >> 3;
+#endif
+		values.resize(StorageSize(nx, ny), value);
+		data = values.data();
+		count = int(values.size());
+	}
+
+	/*
+	\brief Constructor, the values being stored in a mapped file, in the layout of the field. Writes go to
+	the file. The mapping is kept alive by the field and its moved versions.
+	\param nx size in x axis
+	\param ny size in y axis
+	\param bbox bounding box of the domain
+	\param file mapped file
+	\param offset offset of the values in the file, in bytes
+	*/
+	inline ScalarField2D(int nx, int ny, const Box2D& bbox, const std::shared_ptr<FileMapping>& file, size_t offset) : box(bbox), nx(nx), ny(ny), file(file)
+	{
+#if SCALAR_FIELD_TILED
+		tilesX = (nx + 7) >> 3;
+#endif
+		data = reinterpret_cast<float*>(file->Address() + offset);
+		count = int(StorageSize(nx, ny));
 	}
 
 	/*
 	\brief copy constructor
 	\param field Scalarfield2D to copy
 	*/
-	inline ScalarField2D(const ScalarField2D& field) : ScalarField2D(field.nx, field.ny, field.box)
+	inline ScalarField2D(const ScalarField2D& field) : box(field.box), nx(field.nx), ny(field.ny), values(field.data, field.data + field.count)
+	{
+#if SCALAR_FIELD_TILED
+		tilesX = field.tilesX;
+#endif
+		data = values.data();
+		count = field.count;
+	}
+
+	/*
+	\brief Move constructor, mapped storage remains mapped.
+	\param field Scalarfield2D to move
+	*/
+	inline ScalarField2D(ScalarField2D&& field) : ScalarField2D()
+	{
+		Swap(field);
+	}
+
+	/*
+	\brief Assignment operator, the values of a mapped field are copied on the heap unless the field is moved.
+	\param field Scalarfield2D to copy or to move
+	*/
+	inline ScalarField2D& operator=(ScalarField2D field)
+	{
+		Swap(field);
+		return *this;
+	}
+
+	/*
+	\brief Exchange two fields, without copying their values.
+	*/
+	inline void Swap(ScalarField2D& field)
 	{
-		for (unsigned int i = 0; i < values.size(); i++)
-			values[i] = field.values[i];
+		std::swap(box, field.box);
+		std::swap(nx, field.nx);
+		std::swap(ny, field.ny);
+#if SCALAR_FIELD_TILED
+		std::swap(tilesX, field.tilesX);
+#endif
+		values.swap(field.values);
+		std::swap(data, field.data);
+		std::swap(count, field.count);
+		file.swap(field.file);
+	}
+
+	/*
+	\brief Check if the values are stored in a mapped file.
+	*/
+	inline bool Mapped() const
+	{
+		return file != nullptr;
+	}
+
+	/*
+	\brief Returns the mapped file holding the values, if any.
+	*/
+	inline const std::shared_ptr<FileMapping>& Mapping() const
+	{
+		return file;
 	}
 
 	/*
@@ -249,7 +837,7 @@ public:
 		// X Gradient
 		if (i == 0)
 			ret.x = (Get(i + 1, j) - Get(i, j)) / cellSizeX;
-		else if (i == ny - 1)
+		else if (i == nx - 1)
 			ret.x = (Get(i, j) - Get(i - 1, j)) / cellSizeX;
 		else
 			ret.x = (Get(i + 1, j) - Get(i - 1, j)) / (2.0f * cellSizeX);
@@ -257,7 +845,7 @@ public:
 		// Y Gradient
 		if (j == 0)
 			ret.y = (Get(i, j + 1) - Get(i, j)) / cellSizeY;
-		else if (j == nx - 1)
+		else if (j == ny - 1)
 			ret.y = (Get(i, j) - Get(i, j - 1)) / cellSizeY;
 		else
 			ret.y = (Get(i, j + 1) - Get(i, j - 1)) / (2.0f * cellSizeY);
@@ -272,8 +860,8 @@ public:
 	{
 		float min = Min();
 		float max = Max();
-		for (int i = 0; i < ny * nx; i++)
-			values[i] = (values[i] - min) / (max - min);
+		for (int i = 0; i < count; i++)
+			data[i] = (data[i] - min) / (max - min);
 	}
 
 	/*
@@ -284,8 +872,8 @@ public:
 		ScalarField2D ret(*this);
 		float min = Min();
 		float max = Max();
-		for (int i = 0; i < ny * nx; i++)
-			ret.values[i] = (ret.values[i] - min) / (max - min);
+		for (int i = 0; i < ret.count; i++)
+			ret.data[i] = (ret.data[i] - min) / (max - min);
 		return ret;
 	}
 
@@ -295,8 +883,8 @@ public:
 	inline ScalarField2D Sqrt() const
 	{
 		ScalarField2D ret(*this);
-		for (int i = 0; i < values.size(); i++)
-			ret.values[i] = sqrt(ret.values[i]);
+		for (int i = 0; i < count; i++)
+			ret.data[i] = sqrt(ret.data[i]);
 		return ret;
 	}
 
@@ -308,7 +896,7 @@ public:
 		float x = box.Vertex(0).x + i * (box.Vertex(1).x - box.Vertex(0).x) / (nx - 1);
 		float y = Get(i, j);
 		float z = box.Vertex(0).y + j * (box.Vertex(1).y - box.Vertex(0).y) / (ny - 1);
-		return Vector3(z, y, x);
+		return Vector3(x, y, z);
 	}
 
 	/*!
@@ -318,7 +906,7 @@ public:
 	{
 		float x = box.Vertex(0).x + i * (box.Vertex(1).x - box.Vertex(0).x) / (nx - 1);
 		float z = box.Vertex(0).y + j * (box.Vertex(1).y - box.Vertex(0).y) / (ny - 1);
-		return Vector2(z, x);
+		return Vector2(x, z);
 	}
 
 	/*
@@ -329,7 +917,7 @@ public:
 		float x = box.Vertex(0).x + v.x * (box.Vertex(1).x - box.Vertex(0).x) / (nx - 1);
 		float y = Get(v.x, v.y);
 		float z = box.Vertex(0).y + v.y * (box.Vertex(1).y - box.Vertex(0).y) / (ny - 1);
-		return Vector3(z, y, x);
+		return Vector3(x, y, z);
 	}
 
 	/*
@@ -352,8 +940,8 @@ public:
 		float u = q[0] / d[0];
 		float v = q[1] / d[1];
 
-		int j = int(u * (nx - 1));
-		int i = int(v * (ny - 1));
+		int i = int(u * (nx - 1));
+		int j = int(v * (ny - 1));
 
 		return Inside(i, j);
 	}
@@ -369,12 +957,18 @@ public:
 	}
 
 	/*!
-	\brief Utility.
+	\brief Utility. Values are stored row by row, x coordinate first, or by tiles of 8x8 cells.
 	*/
 	inline void ToIndex2D(int index, int& i, int& j) const
 	{
-		i = index / nx;
-		j = index % nx;
+#if SCALAR_FIELD_TILED
+		int tile = index >> 6;
+		i = ((tile % tilesX) << 3) + (index & 7);
+		j = ((tile / tilesX) << 3) + ((index >> 3) & 7);
+#else
+		i = index % nx;
+		j = index / nx;
+#endif
 	}
 
 	/*!
@@ -382,7 +976,7 @@ public:
 	*/
 	inline int ToIndex1D(const Vector2i& v) const
 	{
-		return v.x * nx + v.y;
+		return ToIndex1D(v.x, v.y);
 	}
 
 	/*!
@@ -390,11 +984,15 @@ public:
 	*/
 	inline int ToIndex1D(int i, int j) const
 	{
-		return i * nx + j;
+#if SCALAR_FIELD_TILED
+		return (((j >> 3) * tilesX + (i >> 3)) << 6) + ((j & 7) << 3) + (i & 7);
+#else
+		return j * nx + i;
+#endif
 	}
 
 	/*!
-	\brief Todo
+	\brief Compute the grid cell containing a given world point.
 	*/
 	inline void CellInteger(const Vector2& p, int& i, int& j) const
 	{
@@ -409,8 +1007,8 @@ public:
 		v *= (ny - 1);
 
 		// Integer coordinates
-		i = int(v);
-		j = int(u);
+		i = int(u);
+		j = int(v);
 	}
 
 	/*!
@@ -419,7 +1017,7 @@ public:
 	inline float Get(int row, int column) const
 	{
 		int index = ToIndex1D(row, column);
-		return values[index];
+		return data[index];
 	}
 
 	/*!
@@ -427,7 +1025,7 @@ public:
 	*/
 	inline float Get(int index) const
 	{
-		return values[index];
+		return data[index];
 	}
 
 	/*!
@@ -436,7 +1034,7 @@ public:
 	inline float Get(const Vector2i& v) const
 	{
 		int index = ToIndex1D(v);
-		return values[index];
+		return data[index];
 	}
 
 	/*!
@@ -444,7 +1042,7 @@ public:
 	*/
 	void Add(int i, int j, float v)
 	{
-		values[ToIndex1D(i, j)] += v;
+		data[ToIndex1D(i, j)] += v;
 	}
 
 	/*!
@@ -452,7 +1050,7 @@ public:
 	*/
 	void Remove(int i, int j, float v)
 	{
-		values[ToIndex1D(i, j)] -= v;
+		data[ToIndex1D(i, j)] -= v;
 	}
 
 	/*!
@@ -460,8 +1058,8 @@ public:
 	*/
 	void Add(const ScalarField2D& field)
 	{
-		for (int i = 0; i < values.size(); i++)
-			values[i] += field.values[i];
+		for (int i = 0; i < count; i++)
+			data[i] += field.data[i];
 	}
 
 	/*!
@@ -469,15 +1067,18 @@ public:
 	*/
 	void Remove(const ScalarField2D& field)
 	{
-		for (int i = 0; i < values.size(); i++)
-			values[i] -= field.values[i];
+		for (int i = 0; i < count; i++)
+			data[i] -= field.data[i];
 	}
 
 	/*!
-	\brief Compute the bilinear interpolation at a given world point.
+	\brief Compute the cell containing a given world point, and the local coordinates of the point in this cell.
+	Returns false if the cell or its top right neighbour lies outside the field.
 	\param p world point.
+	\param i, j cell
+	\param localU, localV local coordinates in [0, 1]
 	*/
-	inline float GetValueBilinear(const Vector2& p) const
+	inline bool CellBilinear(const Vector2& p, int& i, int& j, float& localU, float& localV) const
 	{
 		Vector2 q = p - box.Vertex(0);
 		Vector2 d = box.Vertex(1) - box.Vertex(0);
@@ -488,17 +1089,30 @@ public:
 		float u = q[0] / d[0];
 		float v = q[1] / d[1];
 
-		int i = int(v * (ny - 1));
-		int j = int(u * (nx - 1));
+		i = int(u * (nx - 1));
+		j = int(v * (ny - 1));
 
 		if (!Inside(i, j) || !Inside(i + 1, j + 1))
-			return -1.0;
+			return false;
 
-		float anchorU = j * texelX;
-		float anchorV = i * texelY;
+		float anchorU = i * texelX;
+		float anchorV = j * texelY;
 
-		float localU = (u - anchorU) / texelX;
-		float localV = (v - anchorV) / texelY;
+		localU = (u - anchorU) / texelX;
+		localV = (v - anchorV) / texelY;
+		return true;
+	}
+
+	/*!
+	\brief Compute the bilinear interpolation at a given world point.
+	\param p world point.
+	*/
+	inline float GetValueBilinear(const Vector2& p) const
+	{
+		int i, j;
+		float localU, localV;
+		if (!CellBilinear(p, i, j, localU, localV))
+			return -1.0;
 
 		float v1 = Get(i, j);
 		float v2 = Get(i + 1, j);
@@ -506,8 +1120,8 @@ public:
 		float v4 = Get(i, j + 1);
 
 		return (1 - localU) * (1 - localV) * v1
-			+ (1 - localU) * localV * v2
-			+ localU * (1 - localV) * v4
+			+ localU * (1 - localV) * v2
+			+ (1 - localU) * localV * v4
 			+ localU * localV * v3;
 	}
 
@@ -516,7 +1130,7 @@ public:
 	*/
 	inline void Fill(float v)
 	{
-		std::fill(values.begin(), values.end(), v);
+		std::fill(data, data + count, v);
 	}
 
 	/*!
@@ -525,7 +1139,7 @@ public:
 	*/
 	inline float& operator[](int c)
 	{
-		return values[c];
+		return data[c];
 	}
 
 	/*!
@@ -533,7 +1147,7 @@ public:
 	*/
 	inline void Set(int row, int column, float v)
 	{
-		values[ToIndex1D(row, column)] = v;
+		data[ToIndex1D(row, column)] = v;
 	}
 
 	/*!
@@ -541,7 +1155,7 @@ public:
 	*/
 	inline void Set(int index, float v)
 	{
-		values[index] = v;
+		data[index] = v;
 	}
 
 	/*!
@@ -549,54 +1163,63 @@ public:
 	*/
 	inline void ThresholdInferior(float t, float v)
 	{
-		for (int i = 0; i < values.size(); i++)
+		for (int i = 0; i < count; i++)
 		{
-			if (values[i] <= t)
-				values[i] = v;
+			if (data[i] <= t)
+				data[i] = v;
 		}
 	}
 
 	/*!
-	\brief Compute the maximum of the field.
+	\brief Compute the maximum of the field. Padding values are ignored.
 	*/
 	inline float Max() const
 	{
-		if (values.size() == 0)
+		if (count == 0)
 			return 0.0f;
-		float max = values[0];
-		for (int i = 1; i < values.size(); i++)
+		float max = Get(0, 0);
+		for (int j = 0; j < ny; j++)
 		{
-			if (values[i] > max)
-				max = values[i];
+			for (int i = 0; i < nx; i++)
+			{
+				if (Get(i, j) > max)
+					max = Get(i, j);
+			}
 		}
 		return max;
 	}
 
 	/*!
-	\brief Compute the minimum of the field.
+	\brief Compute the minimum of the field. Padding values are ignored.
 	*/
 	inline float Min() const
 	{
-		if (values.size() == 0)
+		if (count == 0)
 			return 0.0f;
-		float min = values[0];
-		for (int i = 1; i < values.size(); i++)
+		float min = Get(0, 0);
+		for (int j = 0; j < ny; j++)
 		{
-			if (values[i] < min)
-				min = values[i];
+			for (int i = 0; i < nx; i++)
+			{
+				if (Get(i, j) < min)
+					min = Get(i, j);
+			}
 		}
 		return min;
 	}
 
 	/*!
-	\brief Compute the average value of the scalarfield.
+	\brief Compute the average value of the scalarfield. Padding values are ignored.
 	*/
 	inline float Average() const
 	{
 		float sum = 0.0f;
-		for (int i = 0; i < values.size(); i++)
-			sum += values[i];
-		return sum / values.size();
+		for (int j = 0; j < ny; j++)
+		{
+			for (int i = 0; i < nx; i++)
+				sum += Get(i, j);
+		}
+		return sum / float(nx * ny);
 	}
 
 	/*!
@@ -640,7 +1263,57 @@ public:
 	}
 
 	/*!
-	\brief Compute the memory used by the field.
+	\brief Reallocate the storage, the values being copied by a parallel loop over blocks of nx values with a
+	static schedule. With a first touch page placement policy, every block is then allocated on the memory node
+	of the thread that processes the corresponding row in parallel loops over rows.
+	Mapped fields are left unchanged, their placement being decided by the page cache.
+	\param threads number of threads
+	*/
+	inline void FirstTouch(int threads)
+	{
+		if (Mapped())
+			return;
+		std::vector<float, AlignedAllocator<float>> touched;
+		touched.resize(count);
+		const int size = int(count);
+		const int blocks = (size + nx - 1) / nx;
+#pragma omp parallel for schedule(static) num_threads(threads)
+		for (int b = 0; b < blocks; b++)
+		{
+			const int end = Math::Min(size, (b + 1) * nx);
+			for (int k = b * nx; k < end; k++)
+				touched[k] = data[k];
+		}
+		values.swap(touched);
+		data = values.data();
+	}
+
+	/*!
+	\brief Returns the stored values, see Storage().
+	*/
+	inline float* Data()
+	{
+		return data;
+	}
+
+	/*!
+	\brief Returns the stored values, see Storage().
+	*/
+	inline const float* Data() const
+	{
+		return data;
+	}
+
+	/*!
+	\brief Returns the number of stored values, including padding. Indices returned by ToIndex1D() are lower.
+	*/
+	inline int Storage() const
+	{
+		return int(count);
+	}
+
+	/*!
+	\brief Compute the heap memory used by the field, mapped values excluded.
 	*/
 	inline int Memory() const
 	{
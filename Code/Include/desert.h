@@ -2,63 +2,476 @@
 
 #include "basics.h"
 
+#include <chrono>
+#include <omp.h>
+
+// Storage of the cached wind field: half precision halves the memory traffic of the saltation loop.
+#ifndef WIND_FIELD_HALF
+#define WIND_FIELD_HALF 0
+#endif
+
+// Layout of the terrain store. By default layers are stored as separate arrays, with a cached total height
+// channel. When interleaved, the layers of a cell are packed together and the layer fields are only
+// synchronized at the end of each step.
+#ifndef TERRAIN_INTERLEAVED
+#define TERRAIN_INTERLEAVED 0
+#endif
+
+// Per phase timers of the simulation steps, see DuneSediment::PhaseTimes(). Off by default, as every timed
+// call reads the clock twice.
+#ifndef DUNE_PROFILE
+#define DUNE_PROFILE 0
+#endif
+
+// Per thread counters of the simulation events, see DuneSediment::Counters(). Off by default.
+#ifndef DUNE_COUNTERS
+#define DUNE_COUNTERS 0
+#endif
+
+// Phases of a simulation step, timed when DUNE_PROFILE is on.
+enum SimulationPhase
+{
+	PhaseLift,					//!< Lift of the grains, including the events that stop before saltation.
+	PhaseSaltation,				//!< Saltation hops and deposition.
+	PhaseShadow,				//!< Wind shadow tests, see DuneSediment::IsInShadow().
+	PhaseReptation,				//!< Reptation.
+	PhaseAbrasion,				//!< Abrasion of the bedrock.
+	PhaseStabilization,			//!< Sediment avalanches, see DuneSediment::StabilizeSedimentRelative().
+	PhaseBedrockStabilization,	//!< Bedrock stabilization, see DuneSediment::StabilizeBedrockAll().
+	PhaseRelaxation,			//!< Relaxation pass, see DuneSediment::RelaxSediments().
+	PhaseCount
+};
+
+// Counters of the simulation events of a step, gathered when DUNE_COUNTERS is on.
+struct SimulationCounters
+{
+	static const int bounceBins = 8;
+	uint64_t events = 0;				//!< Simulation events, ie. lift attempts.
+	uint64_t emptyExits = 0;			//!< Events on cells without sediment.
+	uint64_t shadowExits = 0;			//!< Events whose grain is retained by the wind shadow.
+	uint64_t vegetationExits = 0;		//!< Events whose grain is retained by the vegetation.
+	uint64_t lifted = 0;				//!< Grains lifted.
+	uint64_t deposited = 0;				//!< Grains deposited, the other lifted grains being lost after the last bounce.
+	uint64_t bounces[bounceBins] = {};	//!< Lifted grains by number of bounces, the last bin gathering larger numbers.
+	uint64_t avalanches = 0;			//!< Calls to DuneSediment::StabilizeSedimentRelative().
+	uint64_t avalancheCells = 0;		//!< Cells popped from the stabilization queue.
+	uint64_t avalancheMaxQueue = 0;		//!< Largest length of the stabilization queue.
+	uint64_t abrasions = 0;				//!< Abrasion events that removed bedrock.
+	double saltationMass = 0.0;			//!< Sediment lifted by saltation, in meter.
+	double reptationMass = 0.0;			//!< Sediment moved by reptation, in meter.
+	double avalancheMass = 0.0;			//!< Sediment moved by avalanches, in meter.
+	double abrasionMass = 0.0;			//!< Bedrock removed by abrasion, in meter.
+
+	/*!
+	\brief Add the counters of another thread.
+	*/
+	inline void Add(const SimulationCounters& c)
+	{
+		events += c.events;
+		emptyExits += c.emptyExits;
+		shadowExits += c.shadowExits;
+		vegetationExits += c.vegetationExits;
+		lifted += c.lifted;
+		deposited += c.deposited;
+		for (int b = 0; b < bounceBins; b++)
+			bounces[b] += c.bounces[b];
+		avalanches += c.avalanches;
+		avalancheCells += c.avalancheCells;
+		avalancheMaxQueue = avalancheMaxQueue > c.avalancheMaxQueue ? avalancheMaxQueue : c.avalancheMaxQueue;
+		abrasions += c.abrasions;
+		saltationMass += c.saltationMass;
+		reptationMass += c.reptationMass;
+		avalancheMass += c.avalancheMass;
+		abrasionMass += c.abrasionMass;
+	}
+
+	/*!
+	\brief Returns the total amount of matter moved, in meter.
+	*/
+	inline double MassMoved() const
+	{
+		return saltationMass + reptationMass + avalancheMass + abrasionMass;
+	}
+};
+
+// Mass balance of the layers, see DuneSediment::SetValidationMode(). Sums are sums of elevations over the cells,
+// in meter, changes being measured from the state of the simulation when the validation was turned on.
+struct MassReport
+{
+	int step = 0;					//!< Number of steps performed.
+	double sediment = 0.0;			//!< Total sediment.
+	double bedrock = 0.0;			//!< Total bedrock.
+	double lostSediment = 0.0;		//!< Sediment of the grains lost after the last bounce.
+	double abradedBedrock = 0.0;	//!< Bedrock removed by abrasion.
+	double sedimentDrift = 0.0;		//!< Change of the total sediment not explained by lost grains.
+	double bedrockDrift = 0.0;		//!< Change of the total bedrock not explained by abrasion.
+	int negativeSediment = 0;		//!< Cells with a negative sediment elevation.
+	int negativeBedrock = 0;		//!< Cells with a negative bedrock elevation.
+	float minSediment = 0.0f;		//!< Lowest sediment elevation.
+};
+
+// Cell of the interleaved terrain store.
+struct TerrainCell
+{
+	float bedrock;		//!< Bedrock elevation, in meter.
+	float sediment;		//!< Sediment elevation, in meter.
+	float vegetation;	//!< Vegetation presence in [0, 1].
+	float height;		//!< Cached total height, bedrock plus sediment.
+};
+
+// Physical parameters of the simulation. Default values are the ones used in the paper.
+struct SimulationParams
+{
+	float tanThresholdAngleSediment = 0.60f;		//!< Repose angle of sand, ~33.
+	float tanThresholdAngleWindShadowMin = 0.08f;	//!< Angle at which the wind shadow starts, ~5.
+	float tanThresholdAngleWindShadowMax = 0.26f;	//!< Angle at which cells are fully in the wind shadow, ~15.
+	float tanThresholdAngleBedrock = 2.5f;			//!< Repose angle of bedrock, ~68.
+	float matterToMove = 0.1f;						//!< Amount of sand transported by the wind, in meter.
+	int maxBounce = 3;								//!< Maximum number of saltation hops of a grain.
+	float sandDeposition = 0.6f;					//!< Deposition probability on a sandy cell.
+	float sandVegetationDeposition = 0.4f;			//!< Deposition probability on a sandy cell added by vegetation, times vegetation.
+	float bedrockDeposition = 0.4f;					//!< Deposition probability on a cell without sand.
+	float bedrockVegetationDeposition = 0.6f;		//!< Deposition probability on a cell without sand added by vegetation, times vegetation.
+	float abrasionProbability = 0.2f;				//!< Abrasion probability at every hop.
+	float abrasionSediment = 0.5f;					//!< Sand thickness below which abrasion occurs, in meter.
+	float abrasionEpsilon = 0.5f;					//!< Amount of bedrock removed by abrasion, in meter.
+	float shadowRadius = 10.0f;						//!< Distance up to which the wind shadow is searched, in meter.
+	float reptationRadius = 2.0f;					//!< Maximum distance of reptation, in meter.
+
+	bool IsDefault() const;
+};
+
+// Default parameters. Functions templated on a Default flag read them as compile time constants.
+static constexpr SimulationParams defaultSimulationParams = SimulationParams();
+
+// Grains of a saltation batch, stored as arrays.
+struct GrainBatch
+{
+	std::vector<int> startI, startJ;	//!< Lift cell.
+	std::vector<int> destI, destJ;		//!< Current cell.
+	std::vector<float> x, y;			//!< Current world position.
+	std::vector<float> windX, windY;	//!< Wind at the current cell.
+	std::vector<int> bounce;			//!< Number of bounces.
+	std::vector<uint8_t> alive;			//!< Whether the grain is still moving.
+	std::vector<uint8_t> lifted;		//!< Whether the grain was lifted.
+};
+
+// Per thread layer changes, accumulated by chunks of 64 consecutive cells allocated on first write.
+struct DeltaBuffer
+{
+	std::vector<int> chunkOffset;		//!< Offset of every chunk in values, -1 if not allocated.
+	std::vector<int> chunks;			//!< Allocated chunks, in allocation order.
+	std::vector<float> values;			//!< Per chunk, 64 sediment changes followed by 64 bedrock changes.
+};
+
+// Per thread simulation data, indexed by OpenMP thread number.
+struct DuneThreadData
+{
+	int windowI = 0, windowJ = 0;		//!< First cell of the region the thread is allowed to modify.
+	int windowNx = 0, windowNy = 0;		//!< Size of the region, in cells. Wraps around the grid borders.
+	CellQueue queue;					//!< Stabilization worklist, reused across calls.
+	std::vector<Vector2i> bedrockDirty;	//!< Cells whose bedrock changed since the last bedrock stabilization.
+	GrainBatch batch;					//!< Saltation batch, reused across calls.
+	DeltaBuffer delta;					//!< Layer changes of the thread, if delta buffers are on.
+	std::vector<int> active;			//!< Active cells owned by the thread: the cells of its tile and the cells activated during the step.
+	std::vector<int> touched;			//!< Cells updated by the thread with atomic writes, whose cached heights may be stale, see RefreshTerrainHeights().
+	const int* activeCells = nullptr;	//!< Active cells shared by all the threads, gathered at the beginning of the step.
+	int activeCount = 0;				//!< Number of shared active cells.
+	int activeDraws = 0;				//!< Remaining draws of the uniform start cell selection replaced by the active cells.
+	int activeI = 0, activeJ = 0;		//!< First cell of the region start cells are drawn from.
+	int activeNx = 0, activeNy = 0;		//!< Size of the region, empty if the active cell set is not used.
+	double lostSediment = 0.0;			//!< Sediment of the grains lost after the last bounce, see MassReport.
+	double abradedBedrock = 0.0;		//!< Bedrock removed by abrasion, see MassReport.
+#if DUNE_COUNTERS
+	SimulationCounters counters;		//!< Counters of the current step.
+#endif
+#if DUNE_PROFILE
+	mutable double phaseSeconds[PhaseCount] = {};				//!< Time spent in every phase, in seconds.
+	mutable int phase = -1;										//!< Current phase, -1 outside of the timed phases.
+	mutable std::chrono::steady_clock::time_point phaseStart;	//!< Start of the current phase, or of its last resumption.
+#endif
+};
+
+#if DUNE_PROFILE
+// Scoped timer of a simulation phase. Time spent in nested phases is only counted in the innermost one.
+class PhaseTimer
+{
+protected:
+	const DuneThreadData& td;	//!< Data of the calling thread.
+	int parent;					//!< Phase interrupted by this one, -1 if none.
+
+public:
+	/*!
+	\brief Constructor, starts the phase.
+	\param t data of the calling thread
+	\param phase timed phase
+	*/
+	inline PhaseTimer(const DuneThreadData& t, SimulationPhase phase) : td(t), parent(t.phase)
+	{
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (parent >= 0)
+			td.phaseSeconds[parent] += std::chrono::duration<double>(now - td.phaseStart).count();
+		td.phase = phase;
+		td.phaseStart = now;
+	}
+
+	/*!
+	\brief Destructor, ends the phase and resumes the interrupted one.
+	*/
+	inline ~PhaseTimer()
+	{
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		td.phaseSeconds[td.phase] += std::chrono::duration<double>(now - td.phaseStart).count();
+		td.phase = parent;
+		td.phaseStart = now;
+	}
+};
+#define DUNE_PHASE_NAME(line) phaseTimer##line
+#define DUNE_PHASE_TIMER(p, line) PhaseTimer DUNE_PHASE_NAME(line)(ThreadData(), p)
+#define DUNE_PHASE(p) DUNE_PHASE_TIMER(p, __LINE__)
+#else
+#define DUNE_PHASE(p)
+#endif
+
+// Update of a counter of the calling thread, compiled out unless DUNE_COUNTERS is on.
+#if DUNE_COUNTERS
+#define DUNE_COUNT(counter, v) (ThreadData().counters.counter += (v))
+#define DUNE_COUNT_MAX(counter, v) (ThreadData().counters.counter = Math::Max(ThreadData().counters.counter, uint64_t(v)))
+#else
+#define DUNE_COUNT(counter, v)
+#define DUNE_COUNT_MAX(counter, v)
+#endif
+
+struct SnapshotHeader;
+
 class DuneSediment
 {
 private:
-	float tanThresholdAngleSediment = 0.60f;		// ~33
-	float tanThresholdAngleWindShadowMin = 0.08f;	// ~5
-	float tanThresholdAngleWindShadowMax = 0.26f;	// ~15
-	float tanThresholdAngleBedrock = 2.5f;			// ~68
-
+	bool defaultParams = true;
 	bool vegetationOn = false;
 	bool abrasionOn = false;
+	bool deterministicOn = false;
+	bool atomicWrites = true;
+	bool deltaBuffersOn = false;
+	bool deltaWrites = false;
+	bool shadowCacheOn = false;
+	bool windCacheOn = false;
+	bool deferAvalanchesOn = false;
+	int relaxationPeriod = 0;
+	int relaxationIterations = 4;
+	int batchSize = 0;
+	int streamTileSize = 0;
+	int threadCount = 0;
+	bool threadPinningOn = false;
+	int distributedThreads = 0;
+	bool validationOn = false;
+	bool activeCellsOn = false;
+	bool kineticOn = false;
+	bool kineticWrites = false;
+	bool heightsStale = false;
+	int touchedLimit = 0;
+	bool terrainStoreOn = false;
 
 protected:
 	ScalarField2D bedrock;			//!< Bedrock elevation layer, in meter.
 	ScalarField2D sediments;		//!< Sediment elevation layer, in meter.
 	ScalarField2D vegetation;		//!< Vegetation presence in [0, 1].
+#if TERRAIN_INTERLEAVED
+	std::vector<TerrainCell, AlignedAllocator<TerrainCell>> cells;	//!< Interleaved layers, read and written by the simulation.
+#else
+	ScalarField2D heights;			//!< Cached total height, bedrock plus sediment.
+#endif
+	ScalarField2D shadows;			//!< Wind shadow at the beginning of the step, if the shadow cache is on.
+#if WIND_FIELD_HALF
+	std::vector<uint16_t> windField;	//!< Wind at the beginning of the step, if the wind cache is on. Two components per cell.
+#else
+	std::vector<float> windField;		//!< Wind at the beginning of the step, if the wind cache is on. Two components per cell.
+#endif
 
 	Box2D box;						//!< World space bounding box.
 	int nx, ny;						//!< Grid resolution.
-	float matterToMove;				//!< Amount of sand transported by the wind, in meter.
-	float cellSize;					//!< Size of one cell in meter, squared. Stored to speed up the simulation.
+	SimulationParams params;		//!< Physical parameters.
+	float cellSize;					//!< Size of one cell in meter. Cells are square. Stored to speed up the simulation.
 	Vector2 wind;					//!< Base wind direction.
+	uint64_t seed;					//!< Run seed, from which all random streams are derived.
+	int stepCount;					//!< Number of simulation steps performed so far.
+	std::vector<DuneThreadData> threadData;	//!< Per thread data.
+	std::vector<uint8_t> bedrockMarks;		//!< Cells gathered by the bedrock stabilization, cleared after use.
+	bool bedrockDirtyAll;					//!< Whether the whole bedrock should be stabilized.
+	std::vector<uint64_t> bedrockDirtyBits;	//!< Cells whose bedrock changed since the last stabilization, one bit per cell, used by the streamed step.
+	std::vector<float> relaxRates;			//!< Outgoing sand rate of every cell, used by the relaxation pass.
+	std::vector<float> relaxDeltas;			//!< Sediment change of every cell, used by the relaxation pass.
+	std::vector<int> deltaChunks;			//!< Chunks modified by at least one thread, used by the delta reduction.
+	std::vector<uint8_t> deltaMarks;		//!< Chunks gathered by the delta reduction, cleared after use.
+	std::vector<int> activeCells;			//!< Cells with sediment at the beginning of the step, if the active cell set is on.
+	std::vector<int> activeRows;			//!< Number of active cells of every row, then offset of the row in activeCells.
+	std::vector<uint8_t> activeMarks;		//!< Cells in an active cell list, cleared after use.
+	std::vector<float> liftRates;			//!< Lift propensity of every cell, if the kinetic mode is on.
+	FenwickTree liftTree;					//!< Partial sums of the lift propensities, used to sample the lifted cells.
+	std::vector<int> kineticChanges;		//!< Cells modified by the current kinetic event.
+	std::vector<int> kineticCells;			//!< Cells whose propensity is updated after the current kinetic event.
+	std::vector<uint8_t> kineticMarks;		//!< Cells in kineticCells, cleared after use.
+	double kineticTime = 0.0;				//!< Time of the last kinetic event, in steps.
+	MassReport massReference;				//!< Mass balance when the validation was turned on.
+	MassReport massReport;					//!< Mass balance after the last step, if the validation is on.
 
 public:
 	DuneSediment();
-	DuneSediment(const Box2D& bbox, float rMin, float rMax, const Vector2& w);
+	DuneSediment(const Box2D& bbox, float rMin, float rMax, const Vector2& w, uint64_t s = 0);
+	DuneSediment(const Box2D& bbox, int resX, int resY, float rMin, float rMax, const Vector2& w, uint64_t s = 0);
+	DuneSediment(int nx, int ny, float size, float rMin, float rMax, const Vector2& w, uint64_t s = 0);
+	DuneSediment(int resX, int resY);
+	DuneSediment(const DuneSediment&) = default;
+	DuneSediment(DuneSediment&&) = default;
+	DuneSediment& operator=(const DuneSediment&) = default;
+	DuneSediment& operator=(DuneSediment&&) = default;
 	~DuneSediment();
 
 	// Simulation
 	int ToIndex1D(const Vector2i& q) const;
 	int ToIndex1D(int i, int j) const;
 	void SimulationStepMultiThreadAtomic();
+	void SimulationStepMultiThreadTiled();
+	void SimulationStepTile(int tileI, int tileJ, int tileNx, int tileNy);
+	void SimulationStepStreamed();
+	void SimulationStepKinetic();
+	float LiftPropensity(int i, int j) const;
+	void UpdateLiftPropensities();
+	void SimulationStepStreamedTile(DuneSediment& window, int tileI, int tileJ, int tileNx, int tileNy);
+	void StabilizeStreamedTile(DuneSediment& window, int tileI, int tileJ, int tileNx, int tileNy, bool relax, bool stabilize);
+	void UpdateActiveCells();
+	void GatherActiveCells(int firstI, int firstJ, int sizeI, int sizeJ, DuneThreadData& td);
+	void ClearActiveCells(DuneThreadData& td);
+	bool NextActiveCell(DuneThreadData& td, int& startI, int& startJ);
+	void LoadWindow(DuneSediment& window, int firstI, int firstJ, int sizeI, int sizeJ) const;
+	void StoreWindow(DuneSediment& window, int firstI, int firstJ, int windowI, int windowJ, int windowNx, int windowNy);
+	void MarkBedrockDirty(int id);
+	void PackBedrockDirty();
+	void UnpackBedrockDirty();
+	int BeginSimulationStep();
 	void EndSimulationStep();
 	void SimulationStepWorldSpace();
-	void PerformReptationOnCell(int i, int j, int bounce);
+	void SimulationStepWorldSpace(int startI, int startJ);
+	template<bool Default> void SimulationEvent(int startI, int startJ);
+	template<bool Default> void SaltationEvent(int startI, int startJ);
+	template<bool Default> bool SaltationBounce(int start1D, int destI, int destJ, const Vector2& windDir, int& bounce);
+	void SimulationStepBatch(int firstI, int firstJ, int sizeI, int sizeJ, int count);
+	template<bool Default> void SimulationBatch(int firstI, int firstJ, int sizeI, int sizeJ, int count);
+	template<bool Default> void PerformReptationOnCell(int i, int j, int bounce);
 	void ComputeWindAtCell(int i, int j, Vector2& windDir) const;
+	void WindAtCell(int i, int j, Vector2& windDir) const;
+	void UpdateWindField();
 	float IsInShadow(int i, int j, const Vector2& wind) const;
+	float ShadowAtCell(int i, int j, const Vector2& windDir) const;
+	void UpdateShadowField();
 	void SnapWorld(Vector2& p) const;
 	int CheckSedimentFlowRelative(const Vector2i& p, float tanThresholdAngle, Vector2i* nei, float* nslope) const;
 	int CheckBedrockFlowRelative(const Vector2i& p, float tanThresholdAngle, Vector2i* nei, float * nslope) const;
-	void StabilizeSedimentRelative(int i, int j);
-	bool StabilizeBedrockRelative(int i, int j);
+	template<bool Default> void StabilizeSedimentRelative(int i, int j);
+	template<bool Default> bool StabilizeBedrockRelative(int i, int j);
 	void StabilizeBedrockAll();
-	void PerformAbrasionOnCell(int i, int j, const Vector2& windDir);
+	void RelaxSediments(int iterations, int firstI, int firstJ, int sizeI, int sizeJ);
+	template<bool Default> void PerformAbrasionOnCell(int i, int j, const Vector2& windDir);
+	void ResetThreadData(int n);
+	void PinThreads();
+	void DistributeStorage();
+	DuneThreadData& ThreadData();
+	const DuneThreadData& ThreadData() const;
+	bool InsideWindow(const DuneThreadData& t, int i, int j) const;
+	bool InsideStencil(const DuneThreadData& t, const Vector2i& p) const;
+	void NeighbourHeights(const DuneThreadData& t, const Vector2i& p, float zp, float* z) const;
+	void AddSediment(int id, float v);
+	void MarkActive(int id);
+	void RecordTouched(int id);
+	void AddBedrock(int id, float v);
+	float* DeltaAt(int id);
+	const float* FindDelta(int id) const;
+	void ReduceDeltaBuffers();
+	float BedrockAt(int id) const;
+	float SedimentAt(int id) const;
+	float VegetationAt(int id) const;
+	float HeightAt(int id) const;
+	Vector2 SedimentGradient(int i, int j) const;
+	void BuildTerrainStore();
+	void ReleaseTerrainStore();
+	void FlushTerrainStore();
+	void RefreshTerrainHeights();
+	void RefreshTerrainHeight(int id);
+	MassReport MeasureMass() const;
+	void ResetMassReport();
+	void UpdateMassReport();
+	void SnapshotState(SnapshotHeader& header, std::vector<int32_t>& dirty) const;
+	void RestoreSnapshotState(const SnapshotHeader& header, ScalarField2D* layers, const std::vector<int32_t>& dirty);
+	void Resample(int resX, int resY);
 
 	// Exports
 	void ExportObj(const std::string& file) const;
 	void ExportJPG(const std::string& url) const;
+	bool SaveSnapshot(const std::string& url) const;
+	bool LoadSnapshot(const std::string& url);
+	bool MapSnapshot(const std::string& url);
+	bool SyncSnapshot() const;
+	const std::shared_ptr<FileMapping>& SnapshotFile() const;
 
 	// Inlined functions and query
 	float Height(int i, int j) const;
 	float Height(const Vector2& p) const;
 	float Bedrock(int i, int j) const;
 	float Sediment(int i, int j) const;
+	int SizeX() const;
+	int SizeY() const;
+	float CellSize() const;
 	void SetAbrasionMode(bool c);
 	void SetVegetationMode(bool c);
+	void SetDeterministicMode(bool c);
+	void SetShadowCacheMode(bool c);
+	void SetWindCacheMode(bool c);
+	void SetRelaxationMode(int period, int iterations = 4);
+	void SetDeferredAvalancheMode(bool c);
+	void SetBatchMode(int size);
+	void SetDeltaBufferMode(bool c);
+	void SetStreamingMode(int tileSize);
+	void SetValidationMode(bool c);
+	void SetActiveCellMode(bool c);
+	void SetKineticMode(bool c);
+	double KineticTime() const;
+	const MassReport& LastMassReport() const;
+	void SetThreadCount(int n);
+	int ThreadCount() const;
+	void SetThreadPinningMode(bool c);
+	void SetParams(const SimulationParams& p);
+	const SimulationParams& Params() const;
+	SimulationCounters Counters() const;
+	void PhaseTimes(double* seconds) const;
+	void ResetPhaseTimes();
+	void SetSeed(uint64_t s);
+	uint64_t Seed() const;
+	int StepCount() const;
 };
 
+/*!
+\brief Check if the parameters are the default ones.
+*/
+inline bool SimulationParams::IsDefault() const
+{
+	const SimulationParams d;
+	return tanThresholdAngleSediment == d.tanThresholdAngleSediment &&
+		tanThresholdAngleWindShadowMin == d.tanThresholdAngleWindShadowMin &&
+		tanThresholdAngleWindShadowMax == d.tanThresholdAngleWindShadowMax &&
+		tanThresholdAngleBedrock == d.tanThresholdAngleBedrock &&
+		matterToMove == d.matterToMove &&
+		maxBounce == d.maxBounce &&
+		sandDeposition == d.sandDeposition &&
+		sandVegetationDeposition == d.sandVegetationDeposition &&
+		bedrockDeposition == d.bedrockDeposition &&
+		bedrockVegetationDeposition == d.bedrockVegetationDeposition &&
+		abrasionProbability == d.abrasionProbability &&
+		abrasionSediment == d.abrasionSediment &&
+		abrasionEpsilon == d.abrasionEpsilon &&
+		shadowRadius == d.shadowRadius &&
+		reptationRadius == d.reptationRadius;
+}
+
 /*!
 \brief Compute the 1D index from a given grid vertex.
 \param q grid vertex.
@@ -78,19 +491,335 @@ inline int DuneSediment::ToIndex1D(const Vector2i& q) const
 }
 
 /*!
-\brief
+\brief Returns the data of the calling thread.
+*/
+inline DuneThreadData& DuneSediment::ThreadData()
+{
+	return threadData[omp_get_thread_num()];
+}
+
+/*!
+\brief Returns the data of the calling thread.
+*/
+inline const DuneThreadData& DuneSediment::ThreadData() const
+{
+	return threadData[omp_get_thread_num()];
+}
+
+/*!
+\brief Mark the bedrock of a cell as changed since the last stabilization, in the bit set of the streamed step.
+Bits of the cells of several threads share words, so the update is atomic.
+\param id cell index
+*/
+inline void DuneSediment::MarkBedrockDirty(int id)
+{
+	const uint64_t bit = uint64_t(1) << (id & 63);
+#pragma omp atomic
+	bedrockDirtyBits[id >> 6] |= bit;
+}
+
+/*!
+\brief Check if a grid vertex lies in the region a thread is allowed to modify.
+\param t thread data
+\param i x coordinate
+\param j y coordinate
+*/
+inline bool DuneSediment::InsideWindow(const DuneThreadData& t, int i, int j) const
+{
+	int di = i - t.windowI;
+	int dj = j - t.windowJ;
+	if (di < 0)
+		di += nx;
+	if (dj < 0)
+		dj += ny;
+	return di < t.windowNx && dj < t.windowNy;
+}
+
+/*!
+\brief Returns the changes of the calling thread to a cell, allocating its chunk if needed. The bedrock
+change follows the sediment change by 64 floats.
+\param id cell index
+*/
+inline float* DuneSediment::DeltaAt(int id)
+{
+	DeltaBuffer& d = ThreadData().delta;
+	int& offset = d.chunkOffset[id >> 6];
+	if (offset < 0)
+	{
+		offset = int(d.values.size());
+		d.values.resize(d.values.size() + 128, 0.0f);
+		d.chunks.push_back(id >> 6);
+	}
+	return &d.values[offset + (id & 63)];
+}
+
+/*!
+\brief Returns the changes of the calling thread to a cell, or nullptr if the thread did not modify its chunk.
+\param id cell index
+*/
+inline const float* DuneSediment::FindDelta(int id) const
+{
+	const DeltaBuffer& d = ThreadData().delta;
+	const int offset = d.chunkOffset[id >> 6];
+	return offset < 0 ? nullptr : &d.values[offset + (id & 63)];
+}
+
+/*!
+\brief Add sediment to a cell and update its cached height. With delta buffers, the change is only
+recorded in the buffer of the calling thread. Otherwise the update is atomic unless the scheduler
+guarantees that no other thread can access the cell. Concurrent updates of a cell may then store their
+heights out of order, so the updated cells are recorded and their heights refreshed at the end of the step,
+see RefreshTerrainHeights().
+\param id cell index
+\param v amount of sediment, in meter
+*/
+inline void DuneSediment::AddSediment(int id, float v)
+{
+	if (activeCellsOn && v > 0.0f)
+		MarkActive(id);
+	if (kineticWrites)
+		kineticChanges.push_back(id);
+	if (deltaWrites)
+	{
+		DeltaAt(id)[0] += v;
+		return;
+	}
+#if TERRAIN_INTERLEAVED
+	float& s = cells[id].sediment;
+	float& h = cells[id].height;
+#else
+	float& s = sediments[id];
+	float& h = heights[id];
+#endif
+	if (atomicWrites)
+	{
+		float t;
+#pragma omp atomic capture
+		{ s += v; t = s; }
+		t += BedrockAt(id);
+#pragma omp atomic write
+		h = t;
+		RecordTouched(id);
+	}
+	else
+	{
+		s += v;
+		h = BedrockAt(id) + s;
+	}
+}
+
+/*!
+\brief Record a cell updated with an atomic write, so that its cached height is refreshed at the end of the
+step. Nothing is recorded unless several threads update the grid. Past the limit, the whole grid is refreshed.
+\param id cell index
+*/
+inline void DuneSediment::RecordTouched(int id)
+{
+	if (touchedLimit == 0)
+		return;
+	std::vector<int>& touched = ThreadData().touched;
+	if (int(touched.size()) <= touchedLimit)
+		touched.push_back(id);
+}
+
+/*!
+\brief Add a cell receiving sediment to the active cells of the calling thread, if it is not active yet
+and lies in the region the thread draws its start cells from.
+\param id cell index
+*/
+inline void DuneSediment::MarkActive(int id)
+{
+	DuneThreadData& td = ThreadData();
+	if (td.activeNx == 0)
+		return;
+	int i, j;
+	bedrock.ToIndex2D(id, i, j);
+	if (i < td.activeI || i >= td.activeI + td.activeNx || j < td.activeJ || j >= td.activeJ + td.activeNy)
+		return;
+	// Threads of the atomic scheduler share the marks: only the thread that sets the mark owns the cell
+	uint8_t marked;
+	if (atomicWrites)
+	{
+#pragma omp atomic capture
+		{ marked = activeMarks[id]; activeMarks[id] = 1; }
+	}
+	else
+	{
+		marked = activeMarks[id];
+		activeMarks[id] = 1;
+	}
+	if (marked == 0)
+		td.active.push_back(id);
+}
+
+/*!
+\brief Add bedrock to a cell and update its cached height, see AddSediment().
+\param id cell index
+\param v amount of bedrock, in meter
+*/
+inline void DuneSediment::AddBedrock(int id, float v)
+{
+	if (kineticWrites)
+		kineticChanges.push_back(id);
+	if (deltaWrites)
+	{
+		DeltaAt(id)[64] += v;
+		return;
+	}
+#if TERRAIN_INTERLEAVED
+	float& b = cells[id].bedrock;
+	float& h = cells[id].height;
+#else
+	float& b = bedrock[id];
+	float& h = heights[id];
+#endif
+	if (atomicWrites)
+	{
+		float t;
+#pragma omp atomic capture
+		{ b += v; t = b; }
+		t += SedimentAt(id);
+#pragma omp atomic write
+		h = t;
+		RecordTouched(id);
+	}
+	else
+	{
+		b += v;
+		h = b + SedimentAt(id);
+	}
+}
+
+/*!
+\brief Returns the bedrock elevation of a cell, including the pending changes of the calling thread.
+\param id cell index
+*/
+inline float DuneSediment::BedrockAt(int id) const
+{
+#if TERRAIN_INTERLEAVED
+	float b = cells[id].bedrock;
+#else
+	float b = bedrock.Get(id);
+#endif
+	if (deltaWrites)
+	{
+		const float* d = FindDelta(id);
+		if (d != nullptr)
+			b += d[64];
+	}
+	return b;
+}
+
+/*!
+\brief Returns the sediment elevation of a cell, including the pending changes of the calling thread.
+\param id cell index
+*/
+inline float DuneSediment::SedimentAt(int id) const
+{
+#if TERRAIN_INTERLEAVED
+	float s = cells[id].sediment;
+#else
+	float s = sediments.Get(id);
+#endif
+	if (deltaWrites)
+	{
+		const float* d = FindDelta(id);
+		if (d != nullptr)
+			s += d[0];
+	}
+	return s;
+}
+
+/*!
+\brief Returns the vegetation of a cell.
+\param id cell index
+*/
+inline float DuneSediment::VegetationAt(int id) const
+{
+#if TERRAIN_INTERLEAVED
+	return cells[id].vegetation;
+#else
+	return vegetation.Get(id);
+#endif
+}
+
+/*!
+\brief Returns the total height of a cell, read from the cached height channel.
+\param id cell index
+*/
+inline float DuneSediment::HeightAt(int id) const
+{
+#if TERRAIN_INTERLEAVED
+	float h = cells[id].height;
+#else
+	float h = heights.Get(id);
+#endif
+	if (deltaWrites)
+	{
+		const float* d = FindDelta(id);
+		if (d != nullptr)
+			h += d[0] + d[64];
+	}
+	return h;
+}
+
+/*!
+\brief Compute the wind at a given cell, read from the wind field when the cache is on.
+\param i, j cell
+\param windDir wind direction
+*/
+inline void DuneSediment::WindAtCell(int i, int j, Vector2& windDir) const
+{
+	if (windCacheOn)
+	{
+		const int id = 2 * ToIndex1D(i, j);
+#if WIND_FIELD_HALF
+		windDir = Vector2(Math::HalfToFloat(windField[id]), Math::HalfToFloat(windField[id + 1]));
+#else
+		windDir = Vector2(windField[id], windField[id + 1]);
+#endif
+	}
+	else
+		ComputeWindAtCell(i, j, windDir);
+}
+
+/*!
+\brief Returns the wind shadow of a cell, read from the shadow field when the cache is on.
+\param i, j cell
+\param windDir wind direction at this cell
+*/
+inline float DuneSediment::ShadowAtCell(int i, int j, const Vector2& windDir) const
+{
+	if (shadowCacheOn)
+		return shadows.Get(i, j);
+	return IsInShadow(i, j, windDir);
+}
+
+/*!
+\brief Returns the total height at a given cell. Between the steps, reads the layers if the terrain store
+is not built, see BuildTerrainStore().
 */
 inline float DuneSediment::Height(int i, int j) const
 {
-	return bedrock.Get(i, j) + sediments.Get(i, j);
+	const int id = ToIndex1D(i, j);
+	if (!terrainStoreOn)
+		return bedrock.Get(id) + sediments.Get(id);
+	return HeightAt(id);
 }
 
 /*!
-\brief
+\brief Compute the total height at a given world point by bilinear interpolation.
 */
 inline float DuneSediment::Height(const Vector2& p) const 
 {
-	return bedrock.GetValueBilinear(p) + sediments.GetValueBilinear(p);
+	int i, j;
+	float u, v;
+	if (!bedrock.CellBilinear(p, i, j, u, v))
+		return -1.0f;
+	return (1 - u) * (1 - v) * Height(i, j)
+		+ u * (1 - v) * Height(i + 1, j)
+		+ (1 - u) * v * Height(i, j + 1)
+		+ u * v * Height(i + 1, j + 1);
 }
 
 /*!
@@ -98,7 +827,8 @@ inline float DuneSediment::Height(const Vector2& p) const
 */
 inline float DuneSediment::Bedrock(int i, int j) const
 {
-	return bedrock.Get(i, j);
+	const int id = ToIndex1D(i, j);
+	return terrainStoreOn ? BedrockAt(id) : bedrock.Get(id);
 }
 
 /*!
@@ -106,7 +836,42 @@ inline float DuneSediment::Bedrock(int i, int j) const
 */
 inline float DuneSediment::Sediment(int i, int j) const
 {
-	return sediments.Get(i, j);
+	const int id = ToIndex1D(i, j);
+	return terrainStoreOn ? SedimentAt(id) : sediments.Get(id);
+}
+
+/*!
+\brief Returns the grid resolution along the x axis.
+*/
+inline int DuneSediment::SizeX() const
+{
+	return nx;
+}
+
+/*!
+\brief Returns the grid resolution along the y axis.
+*/
+inline int DuneSediment::SizeY() const
+{
+	return ny;
+}
+
+/*!
+\brief Returns the snapshot the layers are mapped from, if any, see MapSnapshot(). The mapping is owned by the
+layers: a copy of a mapped simulation holds its layers on the heap and is not mapped, a moved simulation
+keeps the mapping.
+*/
+inline const std::shared_ptr<FileMapping>& DuneSediment::SnapshotFile() const
+{
+	return bedrock.Mapping();
+}
+
+/*!
+\brief Returns the size of a cell, in meter.
+*/
+inline float DuneSediment::CellSize() const
+{
+	return cellSize;
 }
 
 /*!
@@ -124,3 +889,252 @@ inline void DuneSediment::SetVegetationMode(bool c)
 {
 	vegetationOn = c;
 }
+
+/*!
+\brief Turn the deterministic mode on or off. In this mode, steps use the tiled scheduler: a run
+only depends on the seed and produces the same bedrock and sediment fields whatever the number of threads.
+*/
+inline void DuneSediment::SetDeterministicMode(bool c)
+{
+	deterministicOn = c;
+}
+
+/*!
+\brief Turn the shadow cache on or off. When on, the wind shadow of every cell is computed once at the
+beginning of each step, and events read it from the shadow field instead of marching upwind. Shadows are
+then not updated by the changes that occur during the step.
+*/
+inline void DuneSediment::SetShadowCacheMode(bool c)
+{
+	shadowCacheOn = c;
+}
+
+/*!
+\brief Turn the wind cache on or off. When on, the wind of every cell is computed once at the
+beginning of each step, and saltation hops read it from the wind field. The wind is then not updated
+by the changes that occur during the step.
+*/
+inline void DuneSediment::SetWindCacheMode(bool c)
+{
+	windCacheOn = c;
+}
+
+/*!
+\brief Turn the relaxation pass on or off. When on, the whole sediment layer is relaxed towards the
+repose angle every few steps, see RelaxSediments().
+\param period number of steps between two passes, 0 turns the pass off
+\param iterations number of iterations of a pass
+*/
+inline void DuneSediment::SetRelaxationMode(int period, int iterations)
+{
+	relaxationPeriod = period;
+	relaxationIterations = iterations;
+}
+
+/*!
+\brief Turn the deferred avalanches on or off. When on and the relaxation pass is on, simulation events
+do not stabilize the cells they modify: avalanches are left to the relaxation pass.
+*/
+inline void DuneSediment::SetDeferredAvalancheMode(bool c)
+{
+	deferAvalanchesOn = c;
+}
+
+/*!
+\brief Turn the batched saltation on or off. When on, simulation events are processed by batches of
+grains, see SimulationStepBatch().
+\param size number of grains of a batch, 0 turns batches off
+*/
+inline void DuneSediment::SetBatchMode(int size)
+{
+	batchSize = size;
+}
+
+/*!
+\brief Turn the delta buffers on or off. When on, the threads of SimulationStepMultiThreadAtomic() record
+their changes in private buffers instead of atomic updates of the layers, and only see their own changes.
+Buffers are reduced into the layers at the end of the step, in thread order.
+*/
+inline void DuneSediment::SetDeltaBufferMode(bool c)
+{
+	deltaBuffersOn = c;
+}
+
+/*!
+\brief Turn the out of core simulation on or off. When on, SimulationStepMultiThreadAtomic() processes the grid
+by tiles copied into small windows, see SimulationStepStreamed(). The result does not depend on the number of threads.
+\param tileSize size of the tiles in cells, 0 turns streaming off
+*/
+inline void DuneSediment::SetStreamingMode(int tileSize)
+{
+	streamTileSize = tileSize;
+}
+
+/*!
+\brief Turn the mass validation on or off. When on, the total sediment and bedrock are measured after every step
+with compensated sums, and compared with the state of the simulation when the validation was turned on, see
+LastMassReport(). Costs a pass over the grid per step.
+*/
+inline void DuneSediment::SetValidationMode(bool c)
+{
+	validationOn = c;
+	if (validationOn)
+		ResetMassReport();
+}
+
+/*!
+\brief Turn the active cell set on or off. When on, the start cells of the events are drawn among the cells
+with sediment, gathered at the beginning of the step and completed as grains are deposited on bare cells.
+Events starting on a cell without sediment do nothing: the draws falling outside the active cells are skipped
+at once, their number following a geometric law, so the step is the same random process and its cost follows
+the sand covered area rather than the size of the grid.
+*/
+inline void DuneSediment::SetActiveCellMode(bool c)
+{
+	activeCellsOn = c;
+}
+
+/*!
+\brief Turn the kinetic Monte Carlo mode on or off. When on, steps are serial and only perform the events that
+lift a grain: every cell has a lift propensity, the probability that an event drawn on the cell lifts its grain,
+and lifted cells are drawn with a probability proportional to their propensity. Every event advances the time by
+an exponential delay of rate the sum of the propensities, one step being the time of nx * ny uniform draws.
+Events retained by the shadow or the vegetation are not performed, nor the avalanches they trigger:
+combine with the relaxation pass to settle the slopes no grain reaches, see SetRelaxationMode().
+*/
+inline void DuneSediment::SetKineticMode(bool c)
+{
+	kineticOn = c;
+}
+
+/*!
+\brief Returns the time of the last kinetic event, in steps since the beginning of the simulation.
+*/
+inline double DuneSediment::KineticTime() const
+{
+	return kineticTime;
+}
+
+/*!
+\brief Returns the mass balance after the last step, see SetValidationMode().
+*/
+inline const MassReport& DuneSediment::LastMassReport() const
+{
+	return massReport;
+}
+
+/*!
+\brief Set the number of threads used by the simulation steps.
+\param n number of threads, 0 uses the OpenMP default, ie. OMP_NUM_THREADS or the number of processors
+*/
+inline void DuneSediment::SetThreadCount(int n)
+{
+	threadCount = n;
+}
+
+/*!
+\brief Returns the number of threads used by the simulation steps.
+*/
+inline int DuneSediment::ThreadCount() const
+{
+	return threadCount > 0 ? threadCount : omp_get_max_threads();
+}
+
+/*!
+\brief Turn the thread pinning on or off. When on, threads are pinned to the processors at the next step,
+spread evenly, and the layers are reallocated by the threads that process them, see DistributeStorage().
+*/
+inline void DuneSediment::SetThreadPinningMode(bool c)
+{
+	threadPinningOn = c;
+	distributedThreads = 0;
+}
+
+/*!
+\brief Set the physical parameters of the simulation.
+\param p parameters
+*/
+inline void DuneSediment::SetParams(const SimulationParams& p)
+{
+	params = p;
+	defaultParams = params.IsDefault();
+}
+
+/*!
+\brief Returns the physical parameters of the simulation.
+*/
+inline const SimulationParams& DuneSediment::Params() const
+{
+	return params;
+}
+
+/*!
+\brief Returns the counters of the last simulation step, summed over the threads. Counters are cleared at
+the beginning of every step, and are zero unless DUNE_COUNTERS is on.
+*/
+inline SimulationCounters DuneSediment::Counters() const
+{
+	SimulationCounters c;
+#if DUNE_COUNTERS
+	for (int t = 0; t < threadData.size(); t++)
+		c.Add(threadData[t].counters);
+#endif
+	return c;
+}
+
+/*!
+\brief Returns the time spent in every phase of the simulation steps since the last reset, summed over the
+threads, in seconds. Times are zero unless DUNE_PROFILE is on.
+\param seconds array of PhaseCount times, see SimulationPhase
+*/
+inline void DuneSediment::PhaseTimes(double* seconds) const
+{
+	for (int p = 0; p < PhaseCount; p++)
+		seconds[p] = 0.0;
+#if DUNE_PROFILE
+	for (int t = 0; t < threadData.size(); t++)
+	{
+		for (int p = 0; p < PhaseCount; p++)
+			seconds[p] += threadData[t].phaseSeconds[p];
+	}
+#endif
+}
+
+/*!
+\brief Reset the phase times, see PhaseTimes().
+*/
+inline void DuneSediment::ResetPhaseTimes()
+{
+#if DUNE_PROFILE
+	for (int t = 0; t < threadData.size(); t++)
+	{
+		for (int p = 0; p < PhaseCount; p++)
+			threadData[t].phaseSeconds[p] = 0.0;
+	}
+#endif
+}
+
+/*!
+\brief Set the run seed. Random streams of the following steps are derived from it.
+\param s seed
+*/
+inline void DuneSediment::SetSeed(uint64_t s)
+{
+	seed = s;
+}
+
+/*!
+\brief Returns the run seed.
+*/
+inline uint64_t DuneSediment::Seed() const
+{
+	return seed;
+}
+
+/*!
+\brief Returns the number of simulation steps performed so far.
+*/
+inline int DuneSediment::StepCount() const
+{
+	return stepCount;
+}
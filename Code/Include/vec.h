@@ -1,7 +1,12 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
 
 /* Forward Declarations */
 struct Vector2i;
@@ -69,6 +74,90 @@ namespace Math
 	{
 		return pow(t, 3.0f) * (t * (t * 6.0f - 15.0f) + 10.0f);
 	}
+
+	/*!
+	\brief Convert a float to half precision, rounding to nearest even.
+	*/
+	inline uint16_t FloatToHalf(float f)
+	{
+#if defined(__F16C__)
+		return uint16_t(_cvtss_sh(f, 0));
+#else
+		uint32_t x;
+		memcpy(&x, &f, sizeof(float));
+		const uint32_t sign = (x >> 16) & 0x8000u;
+		const uint32_t exponent = (x >> 23) & 0xFFu;
+		uint32_t mantissa = x & 0x7FFFFFu;
+
+		// Infinity and NaN
+		if (exponent == 0xFFu)
+			return uint16_t(sign | 0x7C00u | (mantissa != 0 ? 0x200u | (mantissa >> 13) : 0u));
+
+		const int e = int(exponent) - 127 + 15;
+		if (e >= 31)
+			return uint16_t(sign | 0x7C00u);
+
+		// Subnormal half, or zero
+		if (e <= 0)
+		{
+			if (e < -10)
+				return uint16_t(sign);
+			mantissa |= 0x800000u;
+			const int shift = 14 - e;
+			uint32_t h = mantissa >> shift;
+			const uint32_t rest = mantissa & ((1u << shift) - 1u);
+			const uint32_t halfway = 1u << (shift - 1);
+			if (rest > halfway || (rest == halfway && (h & 1u)))
+				h++;
+			return uint16_t(sign | h);
+		}
+
+		// A carry of the rounding correctly propagates to the exponent
+		uint32_t h = sign | (uint32_t(e) << 10) | (mantissa >> 13);
+		const uint32_t rest = mantissa & 0x1FFFu;
+		if (rest > 0x1000u || (rest == 0x1000u && (h & 1u)))
+			h++;
+		return uint16_t(h);
+#endif
+	}
+
+	/*!
+	\brief Convert a half precision value to float.
+	*/
+	inline float HalfToFloat(uint16_t h)
+	{
+#if defined(__F16C__)
+		return _cvtsh_ss(h);
+#else
+		const uint32_t sign = uint32_t(h & 0x8000u) << 16;
+		uint32_t exponent = (h >> 10) & 0x1Fu;
+		uint32_t mantissa = h & 0x3FFu;
+		uint32_t x;
+		if (exponent == 0)
+		{
+			if (mantissa == 0)
+				x = sign;
+			else
+			{
+				// Subnormal half, normalized in float
+				exponent = 127 - 15 + 1;
+				while ((mantissa & 0x400u) == 0)
+				{
+					mantissa <<= 1;
+					exponent--;
+				}
+				x = sign | (exponent << 23) | ((mantissa & 0x3FFu) << 13);
+			}
+		}
+		else if (exponent == 31)
+			x = sign | 0x7F800000u | (mantissa << 13);
+		else
+			x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+		float f;
+		memcpy(&f, &x, sizeof(float));
+		return f;
+#endif
+	}
 }
 
 
@@ -2,46 +2,137 @@
 
 #include <algorithm>
 #include <omp.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 
 static Vector2i next8[8] = { Vector2i(1, 0), Vector2i(1, 1), Vector2i(0, 1), Vector2i(-1, 1), Vector2i(-1, 0), Vector2i(-1, -1), Vector2i(0, -1), Vector2i(1, -1) };
-static float length8[8] = { 1.0f, sqrtf(2.0f), 1.0, sqrtf(2.0f), 1.0f, sqrtf(2.0f), 1.0f, sqrt(2.0f) };
+alignas(32) static float length8[8] = { 1.0f, sqrtf(2.0f), 1.0, sqrtf(2.0f), 1.0f, sqrtf(2.0f), 1.0f, sqrt(2.0f) };
 static Vector2i Next(int i, int j, int k)
 {
 	return Vector2i(i, j) + next8[k];
 }
 
 /*!
-\brief Compute the flow directions at a given point. Returns an integer representing the number of neighbour to distribute
-the material to. Arrays nei and nslope contains respectively the neighbours in grid coordinates and the unit slopes.
+\brief Compute the neighbours of a point steeper than the repose angle, all slopes being computed in one
+vector pass. Returns a mask of the neighbours, and fills their unit slopes. Neighbours that should be
+ignored have the height of the point.
+\param zp height of the point.
+\param z heights of the neighbours.
+\param tanThresholdAngle tangent of the repose angle.
+\param cellSize size of a cell.
+\param slope returned unit slopes, for all neighbours.
+*/
+static int FlowMask(float zp, const float* z, float tanThresholdAngle, float cellSize, float* slope)
+{
+	int mask = 0;
+#if defined(__AVX__)
+	const __m256 step = _mm256_sub_ps(_mm256_set1_ps(zp), _mm256_loadu_ps(z));
+	const __m256 length = _mm256_load_ps(length8);
+	const __m256 angle = _mm256_mul_ps(_mm256_div_ps(step, _mm256_set1_ps(cellSize)), length);
+	const __m256 flow = _mm256_and_ps(_mm256_cmp_ps(step, _mm256_setzero_ps(), _CMP_GT_OQ), _mm256_cmp_ps(angle, _mm256_set1_ps(tanThresholdAngle), _CMP_GT_OQ));
+	mask = _mm256_movemask_ps(flow);
+	_mm256_storeu_ps(slope, _mm256_div_ps(step, length));
+#else
+	for (int i = 0; i < 8; i++)
+	{
+		float step = zp - z[i];
+		if (step > 0.0 && (step / cellSize * length8[i]) > tanThresholdAngle)
+			mask |= 1 << i;
+		slope[i] = step / length8[i];
+	}
+#endif
+	return mask;
+}
+
+/*!
+\brief Compute the flow directions from the heights of the 8 neighbours of a point, see FlowMask().
 \param p Point.
+\param zp height of the point.
+\param z heights of the neighbours.
 \param tanThresholdAngle tangent of the repose angle.
+\param cellSize size of a cell.
 \param nei returned neighbour array.
 \param nslope returned unit slope array.
 */
-int DuneSediment::CheckSedimentFlowRelative(const Vector2i& p, float tanThresholdAngle, Vector2i* nei, float* nslope) const
+static int FlowDirections(const Vector2i& p, float zp, const float* z, float tanThresholdAngle, float cellSize, Vector2i* nei, float* nslope)
 {
-	const float zp = Height(p.x, p.y);
+	alignas(32) float slope[8];
+	int mask = FlowMask(zp, z, tanThresholdAngle, cellSize, slope);
+
+	// Compact, in neighbour order
 	int n = 0;
 	float slopesum = 0.0;
-	for (int i = 0; i < 8; i++)
+	for (int i = 0; mask != 0; i++, mask >>= 1)
 	{
-		Vector2i b = Next(p.x, p.y, i);
-		if (b.x < 0 || b.x >= nx || b.y < 0 || b.y >= ny)
+		if ((mask & 1) == 0)
 			continue;
-		float step = zp - Height(b.x, b.y);
-		if (step > 0.0 && (step / cellSize * length8[i]) > tanThresholdAngle)
-		{
-			nei[n] = b;
-			nslope[n] = step / length8[i];
-			slopesum += nslope[n];
-			n++;
-		}
+		nei[n] = Next(p.x, p.y, i);
+		nslope[n] = slope[i];
+		slopesum += nslope[n];
+		n++;
 	}
 	for (int k = 0; k < n; k++)
 		nslope[k] = nslope[k] / slopesum;
 	return n;
 }
 
+/*!
+\brief Check if the 8 neighbours of a point lie inside the grid and the region the thread is allowed to modify.
+\param t thread data
+\param p Point.
+*/
+bool DuneSediment::InsideStencil(const DuneThreadData& t, const Vector2i& p) const
+{
+	if (p.x < 1 || p.x >= nx - 1 || p.y < 1 || p.y >= ny - 1)
+		return false;
+	return InsideWindow(t, p.x - 1, p.y - 1) && InsideWindow(t, p.x + 1, p.y + 1);
+}
+
+/*!
+\brief Gather the total heights of the 8 neighbours of a point. Neighbours outside the grid or
+the region the thread is allowed to modify get the height of the point.
+\param t thread data
+\param p Point.
+\param zp height of the point.
+\param z returned heights.
+*/
+void DuneSediment::NeighbourHeights(const DuneThreadData& t, const Vector2i& p, float zp, float* z) const
+{
+	if (InsideStencil(t, p))
+	{
+		for (int i = 0; i < 8; i++)
+			z[i] = HeightAt(ToIndex1D(Next(p.x, p.y, i)));
+	}
+	else
+	{
+		for (int i = 0; i < 8; i++)
+		{
+			Vector2i b = Next(p.x, p.y, i);
+			if (b.x < 0 || b.x >= nx || b.y < 0 || b.y >= ny || !InsideWindow(t, b.x, b.y))
+				z[i] = zp;
+			else
+				z[i] = HeightAt(ToIndex1D(b));
+		}
+	}
+}
+
+/*!
+\brief Compute the flow directions at a given point. Returns an integer representing the number of neighbour to distribute
+the material to. Arrays nei and nslope contains respectively the neighbours in grid coordinates and the unit slopes.
+\param p Point.
+\param tanThresholdAngle tangent of the repose angle.
+\param nei returned neighbour array.
+\param nslope returned unit slope array.
+*/
+int DuneSediment::CheckSedimentFlowRelative(const Vector2i& p, float tanThresholdAngle, Vector2i* nei, float* nslope) const
+{
+	const float zp = HeightAt(ToIndex1D(p));
+	float z[8];
+	NeighbourHeights(ThreadData(), p, zp, z);
+	return FlowDirections(p, zp, z, tanThresholdAngle, cellSize, nei, nslope);
+}
+
 /*!
 \brief Compute the flow directions at a given point. Returns an integer representing the number of neighbour to distribute
 the material to. Arrays nei and nslope contains respectively the neighbours in grid coordinates and the unit slopes.
@@ -52,51 +143,56 @@ the material to. Arrays nei and nslope contains respectively the neighbours in g
 */
 int DuneSediment::CheckBedrockFlowRelative(const Vector2i& p, float tanThresholdAngle, Vector2i* nei, float* nslope) const
 {
-	const float zp = Bedrock(p.x, p.y);
-	int n = 0;
-	float slopesum = 0.0;
-	for (int i = 0; i < 8; i++)
+	const DuneThreadData& td = ThreadData();
+	const float zp = BedrockAt(ToIndex1D(p));
+	float z[8];
+	if (InsideStencil(td, p))
 	{
-		Vector2i b = Next(p.x, p.y, i);
-		if (b.x < 0 || b.x >= nx || b.y < 0 || b.y >= ny)
-			continue;
-		float step = zp - Bedrock(b.x, b.y);
-		if (step > 0.0 && (step / cellSize * length8[i]) > tanThresholdAngle)
+		for (int i = 0; i < 8; i++)
+			z[i] = BedrockAt(ToIndex1D(Next(p.x, p.y, i)));
+	}
+	else
+	{
+		for (int i = 0; i < 8; i++)
 		{
-			nei[n] = b;
-			nslope[n] = step / length8[i];
-			slopesum += nslope[n];
-			n++;
+			Vector2i b = Next(p.x, p.y, i);
+			if (b.x < 0 || b.x >= nx || b.y < 0 || b.y >= ny || !InsideWindow(td, b.x, b.y))
+				z[i] = zp;
+			else
+				z[i] = BedrockAt(ToIndex1D(b));
 		}
 	}
-	for (int k = 0; k < n; k++)
-		nslope[k] = nslope[k] / slopesum;
-	return n;
+	return FlowDirections(p, zp, z, tanThresholdAngle, cellSize, nei, nslope);
 }
 
 /*!
 \brief Stabilize a given grid vertex with the use of CheckSedimentFlowRelative() function.
 Used by multi-thread functions, but can also be used in a single-thread context.
+Neighbours outside the region the calling thread is allowed to modify are ignored.
 \param i x coordinate
 \param j y coordinate
 */
+template<bool Default>
 void DuneSediment::StabilizeSedimentRelative(int i, int j)
 {
-	std::vector<Vector2i> queueToStabilize;
+	DUNE_PHASE(PhaseStabilization);
+	const SimulationParams& params = Default ? defaultSimulationParams : this->params;
+	CellQueue& queueToStabilize = ThreadData().queue;
 	Vector2i pts[8];
 	float s[8];
 	int n = 0;
-	queueToStabilize.push_back(Vector2i(i, j));
-	while (queueToStabilize.empty() == false)
+	queueToStabilize.Push(Vector2i(i, j));
+	DUNE_COUNT(avalanches, 1);
+	while (queueToStabilize.Empty() == false)
 	{
-		Vector2i current = queueToStabilize[0];
-		queueToStabilize.erase(queueToStabilize.begin());
+		Vector2i current = queueToStabilize.Pop();
 		int id = ToIndex1D(current);
-		if (sediments.Get(id) <= 0.0)
+		DUNE_COUNT(avalancheCells, 1);
+		if (SedimentAt(id) <= 0.0)
 			continue;
 
 		// Compute flow in all directions
-		n = CheckSedimentFlowRelative(current, tanThresholdAngleSediment, pts, s);
+		n = CheckSedimentFlowRelative(current, params.tanThresholdAngleSediment, pts, s);
 		if (n == 0)
 			continue;
 
@@ -104,42 +200,47 @@ void DuneSediment::StabilizeSedimentRelative(int i, int j)
 		for (int a = 0; a < n; a++)
 		{
 			int nID = ToIndex1D(pts[a]);
-#pragma omp atomic
-			sediments[nID] += matterToMove * s[a];
+			AddSediment(nID, params.matterToMove * s[a]);
 
 			// Push neighbour to latter check stabilization
-			queueToStabilize.push_back(pts[a]);
+			queueToStabilize.Push(pts[a]);
 		}
 
 		// Remove sediments from the current point
-#pragma omp atomic
-		sediments[id] -= matterToMove;
+		AddSediment(id, -params.matterToMove);
+		DUNE_COUNT(avalancheMass, params.matterToMove);
+		DUNE_COUNT_MAX(avalancheMaxQueue, queueToStabilize.Size());
 	}
 }
 
+template void DuneSediment::StabilizeSedimentRelative<true>(int i, int j);
+template void DuneSediment::StabilizeSedimentRelative<false>(int i, int j);
+
 /*!
 \brief Stabilize a given grid vertex with the use of CheckBedrockFlowRelative() function.
 Used by multi-thread functions, but can also be used in a single-thread context.
 \param i x coordinate
 \param j y coordinate
 */
+template<bool Default>
 bool DuneSediment::StabilizeBedrockRelative(int i, int j)
 {
-	std::vector<Vector2i> queueToStabilize;
-	queueToStabilize.push_back(Vector2i(i, j));
+	const SimulationParams& params = Default ? defaultSimulationParams : this->params;
+	CellQueue& queueToStabilize = ThreadData().queue;
+	queueToStabilize.Push(Vector2i(i, j));
 	Vector2i pts[8];
 	float s[8];
 	int n = 0;
 	bool stabilized = true;
-	while (queueToStabilize.empty() == false)
+	while (queueToStabilize.Empty() == false)
 	{
-		Vector2i current = queueToStabilize[0];
+		Vector2i current = queueToStabilize.Front();
 
 		// Compute flow in all directions
-		n = CheckBedrockFlowRelative(current, tanThresholdAngleBedrock, pts, s);
+		n = CheckBedrockFlowRelative(current, params.tanThresholdAngleBedrock, pts, s);
 		if (n == 0)
 		{
-			queueToStabilize.erase(queueToStabilize.begin());
+			queueToStabilize.Pop();
 			continue;
 		}
 		stabilized = false;
@@ -148,25 +249,25 @@ bool DuneSediment::StabilizeBedrockRelative(int i, int j)
 		for (int a = 0; a < n; a++)
 		{
 			int nID = ToIndex1D(pts[a]);
-#pragma omp atomic
-			bedrock[nID] += matterToMove * s[a];
+			AddBedrock(nID, params.matterToMove * s[a]);
 
 			// Push neighbour to latter check stabilization
-			queueToStabilize.push_back(pts[a]);
+			queueToStabilize.Push(pts[a]);
 		}
 
 		// Remove sediments from the current point
-#pragma omp atomic
-		bedrock[ToIndex1D(current)] -= matterToMove;
+		AddBedrock(ToIndex1D(current), -params.matterToMove);
 	}
 	return stabilized;
 }
 
 /*!
-\brief Stabilization function for the bedrock layer.
+\brief Stabilization function for the bedrock layer. Only the cells whose bedrock changed since the
+last call, and their neighbours, are stabilized, from the lowest to the highest.
 */
 void DuneSediment::StabilizeBedrockAll()
 {
+	DUNE_PHASE(PhaseBedrockStabilization);
 	struct SortPredicate
 	{
 		DuneSediment* duneModel;
@@ -174,16 +275,146 @@ void DuneSediment::StabilizeBedrockAll()
 
 		inline bool operator()(Vector2i a, Vector2i b) const
 		{
-			return duneModel->Bedrock(a.x, a.y) < duneModel->Bedrock(b.x, b.y);
+			// Ties are broken by position, so that the order does not depend on the order of the threads
+			const float ba = duneModel->BedrockAt(duneModel->ToIndex1D(a));
+			const float bb = duneModel->BedrockAt(duneModel->ToIndex1D(b));
+			if (ba != bb)
+				return ba < bb;
+			return a.y < b.y || (a.y == b.y && a.x < b.x);
 		}
 	};
 	std::vector<Vector2i> allPoints;
-	for (int i = 0; i < nx; i++)
+	if (bedrockDirtyAll)
 	{
-		for (int j = 0; j < ny; j++)
-			allPoints.push_back(Vector2i(i, j));
+		for (int i = 0; i < nx; i++)
+		{
+			for (int j = 0; j < ny; j++)
+				allPoints.push_back(Vector2i(i, j));
+		}
+	}
+	else
+	{
+		// Gather modified cells and their neighbourhood, without duplicates
+		bedrockMarks.resize(bedrock.Storage(), 0);
+		for (int t = 0; t < threadData.size(); t++)
+		{
+			const std::vector<Vector2i>& dirty = threadData[t].bedrockDirty;
+			for (int k = 0; k < dirty.size(); k++)
+			{
+				for (int a = -1; a <= 1; a++)
+				{
+					for (int b = -1; b <= 1; b++)
+					{
+						Vector2i q = dirty[k] + Vector2i(a, b);
+						if (q.x < 0 || q.x >= nx || q.y < 0 || q.y >= ny)
+							continue;
+						int id = ToIndex1D(q);
+						if (bedrockMarks[id] == 0)
+						{
+							bedrockMarks[id] = 1;
+							allPoints.push_back(q);
+						}
+					}
+				}
+			}
+		}
+		for (int k = 0; k < allPoints.size(); k++)
+			bedrockMarks[ToIndex1D(allPoints[k])] = 0;
 	}
+	for (int t = 0; t < threadData.size(); t++)
+		threadData[t].bedrockDirty.clear();
+	bedrockDirtyAll = false;
+
 	std::sort(allPoints.begin(), allPoints.end(), SortPredicate(this));
 	for (int i = 0; i < allPoints.size(); i++)
-		StabilizeBedrockRelative(allPoints[i].x, allPoints[i].y);
+	{
+		if (defaultParams)
+			StabilizeBedrockRelative<true>(allPoints[i].x, allPoints[i].y);
+		else
+			StabilizeBedrockRelative<false>(allPoints[i].x, allPoints[i].y);
+	}
+}
+
+/*!
+\brief Relax the sediment layer towards the repose angle with Jacobi iterations over the whole grid.
+Every cell steeper than the repose angle sends the amount of sand moved by an avalanche to its
+lower neighbours, proportionally to the slopes, all cells being updated at the same time.
+Rows are processed in parallel: cells only write to themselves, from two buffers of the previous state.
+Sand only leaves the cells of a given region. Called from a parallel region, as on the windows of the streamed step, rows are processed by the calling thread.
+\param iterations number of iterations
+\param firstI, firstJ first cell of the region sand leaves, without wrapping
+\param sizeI, sizeJ size of the region
+*/
+void DuneSediment::RelaxSediments(int iterations, int firstI, int firstJ, int sizeI, int sizeJ)
+{
+	DUNE_PHASE(PhaseRelaxation);
+	const int n = bedrock.Storage();
+	const DuneThreadData& td = ThreadData();
+	const bool nested = omp_in_parallel() != 0;
+	const bool atomic = atomicWrites;
+	relaxRates.resize(n);
+	relaxDeltas.resize(n);
+	atomicWrites = false;
+	for (int it = 0; it < iterations; it++)
+	{
+		// Amount of sand leaving each cell, divided by the sum of its slopes
+#pragma omp parallel for num_threads(int(threadData.size())) if (!nested)
+		for (int j = 0; j < ny; j++)
+		{
+			alignas(32) float slope[8];
+			float z[8];
+			for (int i = 0; i < nx; i++)
+			{
+				const int id = ToIndex1D(i, j);
+				const float zp = HeightAt(id);
+				NeighbourHeights(td, Vector2i(i, j), zp, z);
+				int mask = FlowMask(zp, z, params.tanThresholdAngleSediment, cellSize, slope);
+				float slopesum = 0.0f;
+				for (int k = 0; k < 8; k++)
+					slopesum += (mask >> k) & 1 ? slope[k] : 0.0f;
+				const float out = Math::Min(SedimentAt(id), params.matterToMove);
+				const bool source = i >= firstI && i < firstI + sizeI && j >= firstJ && j < firstJ + sizeJ;
+				relaxRates[id] = source && mask != 0 && out > 0.0f ? out / slopesum : 0.0f;
+			}
+		}
+
+		// Sand received from the higher neighbours. Their slopes towards the cell are the opposite
+		// of the slopes of the cell towards them, so they are computed by the same kernel on negated heights.
+#pragma omp parallel for num_threads(int(threadData.size())) if (!nested)
+		for (int j = 0; j < ny; j++)
+		{
+			alignas(32) float slope[8];
+			float z[8];
+			for (int i = 0; i < nx; i++)
+			{
+				const int id = ToIndex1D(i, j);
+				const float zp = HeightAt(id);
+				NeighbourHeights(td, Vector2i(i, j), zp, z);
+				for (int k = 0; k < 8; k++)
+					z[k] = -z[k];
+				int mask = FlowMask(-zp, z, params.tanThresholdAngleSediment, cellSize, slope);
+				float in = 0.0f;
+				for (int k = 0; mask != 0; k++, mask >>= 1)
+				{
+					if (mask & 1)
+						in += relaxRates[ToIndex1D(Next(i, j, k))] * slope[k];
+				}
+				const float out = relaxRates[id] > 0.0f ? Math::Min(SedimentAt(id), params.matterToMove) : 0.0f;
+				relaxDeltas[id] = in - out;
+			}
+		}
+
+		// Apply
+#pragma omp parallel for num_threads(int(threadData.size())) if (!nested)
+		for (int j = 0; j < ny; j++)
+		{
+			for (int i = 0; i < nx; i++)
+			{
+				const int id = ToIndex1D(i, j);
+				if (relaxDeltas[id] != 0.0f)
+					AddSediment(id, relaxDeltas[id]);
+			}
+		}
+	}
+	atomicWrites = atomic;
 }
@@ -1,55 +1,1111 @@
 #include "desert.h"
 #include "noise.h"
 
+#include <algorithm>
 #include <omp.h>
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 // File scope variables
-#define OMP_NUM_THREAD 8
-#define MAX_BOUNCE 3
+#define STABILIZATION_HALO 8
 
-static float abrasionEpsilon = 0.5;
 static Vector2i next8[8] = { Vector2i(1, 0), Vector2i(1, 1), Vector2i(0, 1), Vector2i(-1, 1), Vector2i(-1, 0), Vector2i(-1, -1), Vector2i(0, -1), Vector2i(1, -1) };
 static Vector2i Next(int i, int j, int k)
 {
 	return Vector2i(i, j) + next8[k];
 }
+static uint64_t StreamIndex(int step, int index)
+{
+	return (uint64_t(step + 1) << 32) | uint64_t(index);
+}
+static int HopReach(float w, float cellSize, const SimulationParams& params)
+{
+	// Wind is at most doubled on slopes
+	return int(ceilf(params.maxBounce * 2.0f * fabsf(w) / cellSize)) + 1;
+}
+static int ShadowReach(float w, float cellSize, const SimulationParams& params)
+{
+	return w != 0.0f ? int(ceilf(params.shadowRadius / cellSize)) + 1 : 0;
+}
+static int TileCount(int n, int reach)
+{
+	// Tiles of the same color are separated by one tile, which must be larger than the reach
+	// of the events of both tiles. An even count keeps the checkerboard valid across the wrapped borders.
+	int count = n / (2 * reach);
+	if (count < 2)
+		return 1;
+	return count - count % 2;
+}
+static std::vector<int> AvailableProcessors()
+{
+	std::vector<int> cpus;
+#if defined(_WIN32)
+	DWORD_PTR processMask, systemMask;
+	if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+	{
+		for (int c = 0; c < 8 * int(sizeof(DWORD_PTR)); c++)
+		{
+			if (processMask & (DWORD_PTR(1) << c))
+				cpus.push_back(c);
+		}
+	}
+#elif defined(__linux__)
+	cpu_set_t mask;
+	if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+	{
+		for (int c = 0; c < CPU_SETSIZE; c++)
+		{
+			if (CPU_ISSET(c, &mask))
+				cpus.push_back(c);
+		}
+	}
+#endif
+	return cpus;
+}
+static void PinThread(int thread, int threads)
+{
+	// Processors available to the process, before any thread is pinned
+	static const std::vector<int> cpus = AvailableProcessors();
+	if (cpus.empty())
+		return;
+	const int cpu = cpus[size_t(thread) * cpus.size() / size_t(threads)];
+#if defined(_WIN32)
+	SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+#elif defined(__linux__)
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+#endif
+}
+static void TileWindow(int first, int size, int n, int& windowFirst, int& windowSize)
+{
+	if (size >= n)
+	{
+		windowFirst = 0;
+		windowSize = n;
+		return;
+	}
+	windowFirst = ((first % n) + n) % n;
+	windowSize = size;
+}
 
 /*!
 \brief Perform a simulation step.
 */
 void DuneSediment::SimulationStepMultiThreadAtomic()
 {
-#pragma omp parallel num_threads(OMP_NUM_THREAD)
+	if (kineticOn)
 	{
+		SimulationStepKinetic();
+		return;
+	}
+	if (streamTileSize > 0)
+	{
+		SimulationStepStreamed();
+		return;
+	}
+	if (deterministicOn)
+	{
+		SimulationStepMultiThreadTiled();
+		return;
+	}
+
+	const int threads = BeginSimulationStep();
+	if (deltaBuffersOn)
+	{
+		const int chunks = (bedrock.Storage() + 63) / 64;
+		for (int t = 0; t < threads; t++)
+		{
+			if (threadData[t].delta.chunkOffset.size() != chunks)
+				threadData[t].delta.chunkOffset.assign(chunks, -1);
+		}
+		deltaWrites = true;
+	}
+	if (activeCellsOn)
+		UpdateActiveCells();
+	// Concurrent updates of a cell may leave its cached height stale: the updated cells are recorded, up to a
+	// quarter of the grid, above which refreshing the whole grid is cheaper
+	if (!deltaWrites && threads > 1)
+		touchedLimit = Math::Max(bedrock.Storage() / (4 * threads), 1);
+	const int events = nx * ny;
+#pragma omp parallel num_threads(threads)
+	{
+		// Each thread draws from its own stream, derived from the run seed, the step and the thread index
+		Random::Seed(seed, StreamIndex(stepCount, omp_get_thread_num()));
+		if (activeCellsOn)
+		{
+			// Threads share the active cells of the beginning of the step, and only see the cells they activate
+			const int t = omp_get_thread_num();
+			DuneThreadData& td = ThreadData();
+			td.activeCells = activeCells.data();
+			td.activeCount = int(activeCells.size());
+			td.activeDraws = int(int64_t(events) * (t + 1) / threads - int64_t(events) * t / threads);
+			td.activeNx = nx;
+			td.activeNy = ny;
+			if (batchSize > 0)
+			{
+				while (td.activeDraws > 0)
+					SimulationStepBatch(0, 0, nx, ny, batchSize);
+			}
+			else
+			{
+				int startI, startJ;
+				while (NextActiveCell(td, startI, startJ))
+					SimulationStepWorldSpace(startI, startJ);
+			}
+		}
+		else if (batchSize > 0)
+		{
+			const int batches = (events + batchSize - 1) / batchSize;
+#pragma omp for
+			for (int a = 0; a < batches; a++)
+				SimulationStepBatch(0, 0, nx, ny, Math::Min(batchSize, events - a * batchSize));
+		}
+		else
+		{
 #pragma omp for
-		for (int a = 0; a < nx; a++)
+			for (int a = 0; a < nx; a++)
+			{
+				for (int b = 0; b < ny; b++)
+					SimulationStepWorldSpace();
+			}
+		}
+	}
+	if (activeCellsOn)
+	{
+		for (int k = 0; k < int(activeCells.size()); k++)
+			activeMarks[activeCells[k]] = 0;
+		for (int t = 0; t < threads; t++)
+			ClearActiveCells(threadData[t]);
+	}
+	if (deltaWrites)
+	{
+		deltaWrites = false;
+		ReduceDeltaBuffers();
+	}
+	else
+		heightsStale = threads > 1;
+	EndSimulationStep();
+}
+
+/*!
+\brief Perform a simulation step with a tiled scheduler. The grid is split into tiles at least twice as large
+as the reach of an event, ie. the saltation distance, the wind shadow distance and the stabilization halo.
+Tiles are colored as a 2x2 checkerboard: tiles of the same color never access the same cells, so they are
+processed concurrently with plain writes, and colors are processed one after the other.
+Each tile draws from its own stream, so the result does not depend on the number of threads.
+*/
+void DuneSediment::SimulationStepMultiThreadTiled()
+{
+	const int reachI = HopReach(wind[0], cellSize, params) + STABILIZATION_HALO + Math::Max(ShadowReach(wind[0], cellSize, params), 1) + 2;
+	const int reachJ = HopReach(wind[1], cellSize, params) + STABILIZATION_HALO + Math::Max(ShadowReach(wind[1], cellSize, params), 1) + 2;
+	const int tilesI = TileCount(nx, reachI);
+	const int tilesJ = TileCount(ny, reachJ);
+	const int colorsI = tilesI > 1 ? 2 : 1;
+	const int colorsJ = tilesJ > 1 ? 2 : 1;
+	const int countI = tilesI / colorsI;
+	const int countJ = tilesJ / colorsJ;
+
+	const int threads = BeginSimulationStep();
+	atomicWrites = false;
+#pragma omp parallel num_threads(threads)
+	{
+		for (int c = 0; c < colorsI * colorsJ; c++)
+		{
+#pragma omp for schedule(dynamic)
+			for (int t = 0; t < countI * countJ; t++)
+			{
+				int ti = c % colorsI + colorsI * (t % countI);
+				int tj = c / colorsI + colorsJ * (t / countI);
+				int i0 = ti * nx / tilesI;
+				int j0 = tj * ny / tilesJ;
+				SimulationStepTile(i0, j0, (ti + 1) * nx / tilesI - i0, (tj + 1) * ny / tilesJ - j0);
+			}
+		}
+	}
+	atomicWrites = true;
+	EndSimulationStep();
+}
+
+/*!
+\brief Perform the simulation events of a tile, one per cell of the tile on average. Modifications
+are restricted to the tile extended by the saltation distance and the stabilization halo.
+\param tileI, tileJ first cell of the tile
+\param tileNx, tileNy size of the tile
+*/
+void DuneSediment::SimulationStepTile(int tileI, int tileJ, int tileNx, int tileNy)
+{
+	const int extentI = HopReach(wind[0], cellSize, params) + STABILIZATION_HALO;
+	const int extentJ = HopReach(wind[1], cellSize, params) + STABILIZATION_HALO;
+	DuneThreadData& td = ThreadData();
+	TileWindow(tileI - extentI, tileNx + 2 * extentI, nx, td.windowI, td.windowNx);
+	TileWindow(tileJ - extentJ, tileNy + 2 * extentJ, ny, td.windowJ, td.windowNy);
+
+	const int events = tileNx * tileNy;
+	Random::Seed(seed, StreamIndex(stepCount, tileI * ny + tileJ));
+	if (activeCellsOn)
+	{
+		GatherActiveCells(tileI, tileJ, tileNx, tileNy, td);
+		if (batchSize > 0)
+		{
+			while (td.activeDraws > 0)
+				SimulationStepBatch(tileI, tileJ, tileNx, tileNy, batchSize);
+		}
+		else
+		{
+			int startI, startJ;
+			while (NextActiveCell(td, startI, startJ))
+				SimulationStepWorldSpace(startI, startJ);
+		}
+		ClearActiveCells(td);
+	}
+	else if (batchSize > 0)
+	{
+		for (int a = 0; a < events; a += batchSize)
+			SimulationStepBatch(tileI, tileJ, tileNx, tileNy, Math::Min(batchSize, events - a));
+	}
+	else
+	{
+		for (int a = 0; a < events; a++)
+		{
+			int startI = tileI + Random::Integer() % tileNx;
+			int startJ = tileJ + Random::Integer() % tileNy;
+			SimulationStepWorldSpace(startI, startJ);
+		}
+	}
+
+	td.windowI = td.windowJ = 0;
+	td.windowNx = nx;
+	td.windowNy = ny;
+}
+
+/*!
+\brief Perform a simulation step out of core. The grid is split into tiles of the streaming size, at least twice
+as large as the reach of an event, colored and scheduled as in SimulationStepMultiThreadTiled(). Every tile is
+copied with a halo into a window, a small simulation of its own, simulated there and copied back. The layers are
+then only accessed by blocks. Caches and the terrain store are not used, and the relaxation and bedrock
+stabilization passes are performed by the tiles as well, see StabilizeStreamedTile(), so that the memory used
+besides the layers is bounded by the tile size, but for one bit per cell marking the bedrock to stabilize.
+With MapSnapshot(), layers are paged in and out of the snapshot as tiles are processed.
+*/
+void DuneSediment::SimulationStepStreamed()
+{
+	const int reachI = HopReach(wind[0], cellSize, params) + STABILIZATION_HALO + Math::Max(ShadowReach(wind[0], cellSize, params), 1) + 2;
+	const int reachJ = HopReach(wind[1], cellSize, params) + STABILIZATION_HALO + Math::Max(ShadowReach(wind[1], cellSize, params), 1) + 2;
+	const int tilesI = TileCount(nx, Math::Max(reachI, streamTileSize / 2));
+	const int tilesJ = TileCount(ny, Math::Max(reachJ, streamTileSize / 2));
+	const int colorsI = tilesI > 1 ? 2 : 1;
+	const int colorsJ = tilesJ > 1 ? 2 : 1;
+	const int countI = tilesI / colorsI;
+	const int countJ = tilesJ / colorsJ;
+
+	// Layers are read and written directly, and pending bedrock modifications are kept as bits
+	const int threads = ThreadCount();
+	ResetThreadData(threads);
+	ReleaseTerrainStore();
+	PackBedrockDirty();
+
+	// Passes of the end of the step, see EndSimulationStep()
+	const bool relax = relaxationPeriod > 0 && (stepCount + 1) % relaxationPeriod == 0;
+	const bool stabilize = abrasionOn && (stepCount + 1) % 5 == 0;
+
+	// Windows are sized for the largest tile
+	const int windowNx = Math::Min(nx, (nx + tilesI - 1) / tilesI + 2 * reachI);
+	const int windowNy = Math::Min(ny, (ny + tilesJ - 1) / tilesJ + 2 * reachJ);
+	std::vector<DuneSediment> windows(threads, DuneSediment(windowNx, windowNy));
+	atomicWrites = false;
+#pragma omp parallel num_threads(threads)
+	{
+		DuneSediment& window = windows[omp_get_thread_num()];
+		for (int c = 0; c < colorsI * colorsJ; c++)
+		{
+#pragma omp for schedule(dynamic)
+			for (int t = 0; t < countI * countJ; t++)
+			{
+				int ti = c % colorsI + colorsI * (t % countI);
+				int tj = c / colorsI + colorsJ * (t / countI);
+				int i0 = ti * nx / tilesI;
+				int j0 = tj * ny / tilesJ;
+				SimulationStepStreamedTile(window, i0, j0, (ti + 1) * nx / tilesI - i0, (tj + 1) * ny / tilesJ - j0);
+			}
+		}
+		for (int c = 0; (relax || stabilize) && c < colorsI * colorsJ; c++)
+		{
+#pragma omp for schedule(dynamic)
+			for (int t = 0; t < countI * countJ; t++)
+			{
+				int ti = c % colorsI + colorsI * (t % countI);
+				int tj = c / colorsI + colorsJ * (t / countI);
+				int i0 = ti * nx / tilesI;
+				int j0 = tj * ny / tilesJ;
+				StabilizeStreamedTile(window, i0, j0, (ti + 1) * nx / tilesI - i0, (tj + 1) * ny / tilesJ - j0, relax, stabilize);
+			}
+		}
+	}
+	atomicWrites = true;
+	if (stabilize)
+		bedrockDirtyAll = false;
+
+	stepCount++;
+	if (validationOn)
+		UpdateMassReport();
+}
+
+/*!
+\brief Perform the simulation events of a tile in a window, see SimulationStepStreamed(). The window covers the
+tile extended by the reach of the events: the saltation distance and the stabilization halo, in which cells are
+modified, and the wind shadow distance, in which cells are only read. Events draw from the stream of the tile.
+\param window simulation holding the window, reused across tiles
+\param tileI, tileJ first cell of the tile
+\param tileNx, tileNy size of the tile
+*/
+void DuneSediment::SimulationStepStreamedTile(DuneSediment& window, int tileI, int tileJ, int tileNx, int tileNy)
+{
+	const int extentI = HopReach(wind[0], cellSize, params) + STABILIZATION_HALO;
+	const int extentJ = HopReach(wind[1], cellSize, params) + STABILIZATION_HALO;
+	const int reachI = extentI + Math::Max(ShadowReach(wind[0], cellSize, params), 1) + 2;
+	const int reachJ = extentJ + Math::Max(ShadowReach(wind[1], cellSize, params), 1) + 2;
+
+	// Window, the whole axis if the halo covers it so that the window wraps as the grid does
+	int firstI = tileI - reachI;
+	int firstJ = tileJ - reachJ;
+	int sizeI = tileNx + 2 * reachI;
+	int sizeJ = tileNy + 2 * reachJ;
+	if (sizeI >= nx)
+	{
+		firstI = 0;
+		sizeI = nx;
+	}
+	if (sizeJ >= ny)
+	{
+		firstJ = 0;
+		sizeJ = ny;
+	}
+	LoadWindow(window, firstI, firstJ, sizeI, sizeJ);
+
+	// Modifications are restricted as in SimulationStepTile(), in window coordinates
+	DuneThreadData& td = window.ThreadData();
+	TileWindow(tileI - extentI - firstI, tileNx + 2 * extentI, sizeI, td.windowI, td.windowNx);
+	TileWindow(tileJ - extentJ - firstJ, tileNy + 2 * extentJ, sizeJ, td.windowJ, td.windowNy);
+
+	const int events = tileNx * tileNy;
+	Random::Seed(seed, StreamIndex(stepCount, tileI * ny + tileJ));
+	if (activeCellsOn)
+	{
+		window.GatherActiveCells(tileI - firstI, tileJ - firstJ, tileNx, tileNy, td);
+		if (batchSize > 0)
+		{
+			while (td.activeDraws > 0)
+				window.SimulationStepBatch(tileI - firstI, tileJ - firstJ, tileNx, tileNy, batchSize);
+		}
+		else
+		{
+			int startI, startJ;
+			while (window.NextActiveCell(td, startI, startJ))
+				window.SimulationStepWorldSpace(startI, startJ);
+		}
+		window.ClearActiveCells(td);
+	}
+	else if (batchSize > 0)
+	{
+		for (int a = 0; a < events; a += batchSize)
+			window.SimulationStepBatch(tileI - firstI, tileJ - firstJ, tileNx, tileNy, Math::Min(batchSize, events - a));
+	}
+	else
+	{
+		for (int a = 0; a < events; a++)
+		{
+			int startI = tileI + Random::Integer() % tileNx;
+			int startJ = tileJ + Random::Integer() % tileNy;
+			window.SimulationStepWorldSpace(startI - firstI, startJ - firstJ);
+		}
+	}
+
+	StoreWindow(window, firstI, firstJ, td.windowI, td.windowJ, td.windowNx, td.windowNy);
+}
+
+/*!
+\brief Perform the relaxation and bedrock stabilization passes of a streamed step on a tile, see
+SimulationStepStreamed(). The window covers the tile extended by the stabilization halo, in which cells are
+modified. Sand only leaves the cells of the tile, and the bedrock of the cells of the tile marked since the last
+stabilization is stabilized, so that every cell is processed once whatever the overlap of the windows.
+\param window simulation holding the window, reused across tiles
+\param tileI, tileJ first cell of the tile
+\param tileNx, tileNy size of the tile
+\param relax whether to relax the sediment layer, see RelaxSediments()
+\param stabilize whether to stabilize the bedrock layer, see StabilizeBedrockAll()
+*/
+void DuneSediment::StabilizeStreamedTile(DuneSediment& window, int tileI, int tileJ, int tileNx, int tileNy, bool relax, bool stabilize)
+{
+	// Window, the whole axis if the halo covers it so that the window wraps as the grid does
+	int firstI = tileI - STABILIZATION_HALO;
+	int firstJ = tileJ - STABILIZATION_HALO;
+	int sizeI = tileNx + 2 * STABILIZATION_HALO;
+	int sizeJ = tileNy + 2 * STABILIZATION_HALO;
+	if (sizeI >= nx)
+	{
+		firstI = 0;
+		sizeI = nx;
+	}
+	if (sizeJ >= ny)
+	{
+		firstJ = 0;
+		sizeJ = ny;
+	}
+	LoadWindow(window, firstI, firstJ, sizeI, sizeJ);
+	DuneThreadData& td = window.ThreadData();
+
+	if (relax)
+		window.RelaxSediments(relaxationIterations, tileI - firstI, tileJ - firstJ, tileNx, tileNy);
+	if (stabilize)
+	{
+		// Marked cells of the tile, whose bits are cleared. Words are shared with the tiles of other threads
+		for (int j = tileJ; j < tileJ + tileNy; j++)
 		{
-			for (int b = 0; b < ny; b++)
-				SimulationStepWorldSpace();
+			for (int i = tileI; i < tileI + tileNx; i++)
+			{
+				const int id = ToIndex1D(i, j);
+				const uint64_t bit = uint64_t(1) << (id & 63);
+				uint64_t word;
+#pragma omp atomic read
+				word = bedrockDirtyBits[id >> 6];
+				if ((word & bit) != 0)
+				{
+#pragma omp atomic
+					bedrockDirtyBits[id >> 6] &= ~bit;
+				}
+				if (bedrockDirtyAll || (word & bit) != 0)
+					td.bedrockDirty.push_back(Vector2i(i - firstI, j - firstJ));
+			}
 		}
+		window.StabilizeBedrockAll();
 	}
+
+	StoreWindow(window, firstI, firstJ, 0, 0, sizeI, sizeJ);
+}
+
+/*!
+\brief Gather the cells with sediment of the whole grid, row by row. Rows are scanned in parallel, and the
+list does not depend on the number of threads.
+*/
+void DuneSediment::UpdateActiveCells()
+{
+	activeRows.assign(ny + 1, 0);
+#pragma omp parallel for num_threads(ThreadCount())
+	for (int j = 0; j < ny; j++)
+	{
+		int n = 0;
+		for (int i = 0; i < nx; i++)
+			n += SedimentAt(ToIndex1D(i, j)) > 0.0f ? 1 : 0;
+		activeRows[j + 1] = n;
+	}
+	for (int j = 0; j < ny; j++)
+		activeRows[j + 1] += activeRows[j];
+	activeCells.resize(activeRows[ny]);
+#pragma omp parallel for num_threads(ThreadCount())
+	for (int j = 0; j < ny; j++)
+	{
+		int k = activeRows[j];
+		for (int i = 0; i < nx; i++)
+		{
+			const int id = ToIndex1D(i, j);
+			if (SedimentAt(id) > 0.0f)
+			{
+				activeCells[k++] = id;
+				activeMarks[id] = 1;
+			}
+		}
+	}
+}
+
+/*!
+\brief Gather the cells with sediment of a region, row by row, as the active cells owned by a thread.
+Start cells of the thread are then drawn from this region, one draw per cell.
+\param firstI, firstJ first cell of the region
+\param sizeI, sizeJ size of the region
+\param td thread data receiving the active cells
+*/
+void DuneSediment::GatherActiveCells(int firstI, int firstJ, int sizeI, int sizeJ, DuneThreadData& td)
+{
+	td.active.clear();
+	for (int j = firstJ; j < firstJ + sizeJ; j++)
+	{
+		for (int i = firstI; i < firstI + sizeI; i++)
+		{
+			const int id = ToIndex1D(i, j);
+			if (SedimentAt(id) > 0.0f)
+			{
+				td.active.push_back(id);
+				activeMarks[id] = 1;
+			}
+		}
+	}
+	td.activeDraws = sizeI * sizeJ;
+	td.activeI = firstI;
+	td.activeJ = firstJ;
+	td.activeNx = sizeI;
+	td.activeNy = sizeJ;
+}
+
+/*!
+\brief Clear the marks of the active cells owned by a thread, and stop drawing start cells from them.
+\param td thread data
+*/
+void DuneSediment::ClearActiveCells(DuneThreadData& td)
+{
+	for (int k = 0; k < int(td.active.size()); k++)
+		activeMarks[td.active[k]] = 0;
+	td.active.clear();
+	td.activeCells = nullptr;
+	td.activeCount = td.activeDraws = 0;
+	td.activeI = td.activeJ = td.activeNx = td.activeNy = 0;
+}
+
+/*!
+\brief Draw the next start cell among the active cells of a thread. This replaces the uniform draws over the
+region of the thread: the draws falling on cells out of the active cells are skipped at once, their number
+following a geometric law. Active cells only grow during a step, so they always include the cells with sediment.
+Returns false once all the draws of the region are done.
+\param td thread data
+\param startI, startJ start cell
+*/
+bool DuneSediment::NextActiveCell(DuneThreadData& td, int& startI, int& startJ)
+{
+	const int count = td.activeCount + int(td.active.size());
+	const double p = double(count) / double(td.activeNx * td.activeNy);
+	if (count == 0)
+		td.activeDraws = 0;
+	else if (p < 1.0)
+	{
+		const double skip = floor(log1p(-double(Random::Uniform())) / log1p(-p));
+		td.activeDraws -= int(Math::Min(skip, double(td.activeDraws)));
+	}
+	if (td.activeDraws <= 0)
+		return false;
+	td.activeDraws--;
+	const int k = Random::Integer() % count;
+	bedrock.ToIndex2D(k < td.activeCount ? td.activeCells[k] : td.active[k - td.activeCount], startI, startJ);
+	return true;
+}
+
+/*!
+\brief Perform a simulation step with the kinetic Monte Carlo scheduler, see SetKineticMode(). Lifted cells are
+drawn from the partial sums of the lift propensities, and the propensities of the cells whose lift test reads a
+modified cell are updated after every event. Events are serial, and draw from the stream of the step.
+*/
+void DuneSediment::SimulationStepKinetic()
+{
+	BeginSimulationStep();
+	atomicWrites = false;
+	UpdateLiftPropensities();
+	kineticMarks.resize(bedrock.Storage(), 0);
+	Random::Seed(seed, StreamIndex(stepCount, 0));
+
+	// Lift tests read the heights upwind, up to the shadow radius, unless the shadows are cached
+	const int reach = shadowCacheOn ? 0 : Math::Max(ShadowReach(wind[0], cellSize, params), ShadowReach(wind[1], cellSize, params));
+	const int stepI = wind[0] > 0.0f ? 1 : wind[0] < 0.0f ? -1 : 0;
+	const int stepJ = wind[1] > 0.0f ? 1 : wind[1] < 0.0f ? -1 : 0;
+	const int halo = shadowCacheOn ? 0 : 1;
+
+	// Delays are exponential, hence memoryless: the first event past the end of the step is dropped
+	double time = 0.0;
+	kineticWrites = true;
+	while (true)
+	{
+		const double total = liftTree.Total();
+		if (total <= 0.0)
+			break;
+		time -= log1p(-Random::UniformDouble()) / total;
+		if (time >= 1.0)
+			break;
+		const int id = liftTree.Find(Random::UniformDouble() * total);
+		if (liftRates[id] <= 0.0f)
+			continue;
+		kineticTime = stepCount + time;
+
+		int startI, startJ;
+		bedrock.ToIndex2D(id, startI, startJ);
+		{
+			DUNE_PHASE(PhaseLift);
+			DUNE_COUNT(events, 1);
+			if (defaultParams)
+				SaltationEvent<true>(startI, startJ);
+			else
+				SaltationEvent<false>(startI, startJ);
+		}
+
+		// Update the propensities of the modified cells and of the cells downwind
+		for (int k = 0; k < int(kineticChanges.size()); k++)
+		{
+			int ci, cj;
+			bedrock.ToIndex2D(kineticChanges[k], ci, cj);
+			for (int r = 0; r <= reach; r++)
+			{
+				for (int b = -halo; b <= halo; b++)
+				{
+					for (int a = -halo; a <= halo; a++)
+					{
+						const int i = (((ci + r * stepI + a) % nx) + nx) % nx;
+						const int j = (((cj + r * stepJ + b) % ny) + ny) % ny;
+						const int c = ToIndex1D(i, j);
+						if (kineticMarks[c] != 0)
+							continue;
+						kineticMarks[c] = 1;
+						kineticCells.push_back(c);
+					}
+				}
+			}
+		}
+		kineticChanges.clear();
+		for (int k = 0; k < int(kineticCells.size()); k++)
+		{
+			const int c = kineticCells[k];
+			int i, j;
+			bedrock.ToIndex2D(c, i, j);
+			const float rate = LiftPropensity(i, j);
+			if (rate != liftRates[c])
+			{
+				liftTree.Add(c, double(rate) - double(liftRates[c]));
+				liftRates[c] = rate;
+			}
+			kineticMarks[c] = 0;
+		}
+		kineticCells.clear();
+	}
+	kineticWrites = false;
+	atomicWrites = true;
 	EndSimulationStep();
 }
 
+/*!
+\brief Compute the lift propensity of a cell, ie. the probability that an event drawn on the cell lifts a grain:
+the cell must have sediment, and the grain must escape the wind shadow and the vegetation.
+\param i, j cell
+*/
+float DuneSediment::LiftPropensity(int i, int j) const
+{
+	const int id = ToIndex1D(i, j);
+	if (SedimentAt(id) <= 0.0f)
+		return 0.0f;
+	Vector2 windDir;
+	WindAtCell(i, j, windDir);
+	float rate = 1.0f - ShadowAtCell(i, j, windDir);
+	if (vegetationOn)
+		rate *= 1.0f - VegetationAt(id);
+	return Math::Max(rate, 0.0f);
+}
+
+/*!
+\brief Compute the lift propensities of all the cells and rebuild their partial sums. Propensities are
+recomputed at the beginning of every kinetic step, so that rounding errors of the updates do not accumulate.
+*/
+void DuneSediment::UpdateLiftPropensities()
+{
+	liftRates.assign(bedrock.Storage(), 0.0f);
+#pragma omp parallel for num_threads(ThreadCount())
+	for (int j = 0; j < ny; j++)
+	{
+		for (int i = 0; i < nx; i++)
+			liftRates[ToIndex1D(i, j)] = LiftPropensity(i, j);
+	}
+	liftTree.Build(liftRates.data(), int(liftRates.size()));
+}
+
+/*!
+\brief Copy a region of the grid into a window, with the modes and parameters of the simulation. Caches,
+delta buffers and atomic writes are turned off in the window.
+\param window simulation receiving the region
+\param firstI, firstJ first cell of the region, wrapped around the grid borders
+\param sizeI, sizeJ size of the region
+*/
+void DuneSediment::LoadWindow(DuneSediment& window, int firstI, int firstJ, int sizeI, int sizeJ) const
+{
+	const Vector2 a = box.BottomLeft() + cellSize * Vector2(float(firstI), float(firstJ));
+	const Vector2 b = box.BottomLeft() + cellSize * Vector2(float(firstI + sizeI - 1), float(firstJ + sizeJ - 1));
+	window.box = Box2D(Vector2(sizeI == nx ? box.BottomLeft()[0] : a[0], sizeJ == ny ? box.BottomLeft()[1] : a[1]),
+		Vector2(sizeI == nx ? box.TopRight()[0] : b[0], sizeJ == ny ? box.TopRight()[1] : b[1]));
+	window.nx = sizeI;
+	window.ny = sizeJ;
+	window.cellSize = cellSize;
+	window.wind = wind;
+	window.seed = seed;
+	window.stepCount = stepCount;
+	window.SetParams(params);
+	window.vegetationOn = vegetationOn;
+	window.abrasionOn = abrasionOn;
+	window.deferAvalanchesOn = deferAvalanchesOn;
+	window.relaxationPeriod = relaxationPeriod;
+	window.batchSize = batchSize;
+	window.activeCellsOn = activeCellsOn;
+	window.atomicWrites = false;
+
+	window.bedrock = ScalarField2D(sizeI, sizeJ, window.box);
+	window.sediments = ScalarField2D(sizeI, sizeJ, window.box);
+	window.vegetation = ScalarField2D(sizeI, sizeJ, window.box);
+	for (int j = 0; j < sizeJ; j++)
+	{
+		const int gj = (((firstJ + j) % ny) + ny) % ny;
+		for (int i = 0; i < sizeI; i++)
+		{
+			const int id = ToIndex1D((((firstI + i) % nx) + nx) % nx, gj);
+			window.bedrock.Set(i, j, bedrock.Get(id));
+			window.sediments.Set(i, j, sediments.Get(id));
+			window.vegetation.Set(i, j, vegetation.Get(id));
+		}
+	}
+	window.BuildTerrainStore();
+	if (activeCellsOn)
+		window.activeMarks.resize(window.bedrock.Storage(), 0);
+	window.ResetThreadData(int(threadData.size()));
+	window.ThreadData().bedrockDirty.clear();
+	window.bedrockDirtyAll = false;
+}
+
+/*!
+\brief Copy the cells of a window that may have been modified back into the layers of the grid, and mark its
+pending bedrock modifications, see MarkBedrockDirty(). Writes are plain, the caller guarantees that no other
+thread accesses these cells.
+\param window simulation holding the region
+\param firstI, firstJ first cell of the region, see LoadWindow()
+\param windowI, windowJ first modified cell, in window coordinates
+\param windowNx, windowNy size of the modified region
+*/
+void DuneSediment::StoreWindow(DuneSediment& window, int firstI, int firstJ, int windowI, int windowJ, int windowNx, int windowNy)
+{
+	for (int j = windowJ; j < windowJ + windowNy; j++)
+	{
+		const int wj = j % window.ny;
+		const int gj = (((firstJ + wj) % ny) + ny) % ny;
+		for (int i = windowI; i < windowI + windowNx; i++)
+		{
+			const int wi = i % window.nx;
+			const int id = ToIndex1D((((firstI + wi) % nx) + nx) % nx, gj);
+			const int wid = window.ToIndex1D(wi, wj);
+			bedrock[id] = window.BedrockAt(wid);
+			sediments[id] = window.SedimentAt(wid);
+		}
+	}
+
+	std::vector<Vector2i>& dirty = window.ThreadData().bedrockDirty;
+	for (int k = 0; k < dirty.size(); k++)
+		MarkBedrockDirty(ToIndex1D((((firstI + dirty[k].x) % nx) + nx) % nx, (((firstJ + dirty[k].y) % ny) + ny) % ny));
+	dirty.clear();
+	ThreadData().lostSediment += window.ThreadData().lostSediment;
+	ThreadData().abradedBedrock += window.ThreadData().abradedBedrock;
+	window.ThreadData().lostSediment = window.ThreadData().abradedBedrock = 0.0;
+#if DUNE_COUNTERS
+	ThreadData().counters.Add(window.ThreadData().counters);
+#endif
+#if DUNE_PROFILE
+	for (int p = 0; p < PhaseCount; p++)
+	{
+		ThreadData().phaseSeconds[p] += window.ThreadData().phaseSeconds[p];
+		window.ThreadData().phaseSeconds[p] = 0.0;
+	}
+#endif
+}
+
+/*!
+\brief Move the pending bedrock modifications of the threads to the bit set of the streamed step, whose memory
+does not grow with the number of modifications.
+*/
+void DuneSediment::PackBedrockDirty()
+{
+	bedrockDirtyBits.resize((bedrock.Storage() + 63) / 64, 0);
+	for (int t = 0; t < threadData.size(); t++)
+	{
+		std::vector<Vector2i>& dirty = threadData[t].bedrockDirty;
+		for (int k = 0; k < dirty.size(); k++)
+			MarkBedrockDirty(ToIndex1D(dirty[k]));
+		std::vector<Vector2i>().swap(dirty);
+	}
+}
+
+/*!
+\brief Move the pending bedrock modifications of the streamed step back to the list of the first thread, so that
+a step of another scheduler stabilizes them, and free the bit set.
+*/
+void DuneSediment::UnpackBedrockDirty()
+{
+	for (int w = 0; w < bedrockDirtyBits.size(); w++)
+	{
+		for (int b = 0; b < 64 && bedrockDirtyBits[w] >> b != 0; b++)
+		{
+			if ((bedrockDirtyBits[w] >> b) & 1)
+			{
+				int i, j;
+				bedrock.ToIndex2D(w * 64 + b, i, j);
+				threadData[0].bedrockDirty.push_back(Vector2i(i, j));
+			}
+		}
+	}
+	std::vector<uint64_t>().swap(bedrockDirtyBits);
+}
+
+/*!
+\brief Prepare a simulation step: per thread data, terrain store, thread placement, caches and active cell marks, which are
+sized here and not in the parallel regions. Returns the number of threads.
+*/
+int DuneSediment::BeginSimulationStep()
+{
+	const int threads = ThreadCount();
+	ResetThreadData(threads);
+	if (!terrainStoreOn)
+		BuildTerrainStore();
+	if (!bedrockDirtyBits.empty())
+		UnpackBedrockDirty();
+	if (activeCellsOn)
+		activeMarks.resize(bedrock.Storage(), 0);
+	if (threadPinningOn && distributedThreads != threads)
+	{
+		PinThreads();
+		DistributeStorage();
+		distributedThreads = threads;
+	}
+	if (shadowCacheOn)
+		UpdateShadowField();
+	if (windCacheOn)
+		UpdateWindField();
+	return threads;
+}
+
+/*!
+\brief Pin the threads of the OpenMP team to the processors available to the process, spread evenly.
+Threads of the following parallel regions with the same number of threads are the same, so they stay pinned.
+*/
+void DuneSediment::PinThreads()
+{
+	const int threads = ThreadCount();
+#pragma omp parallel num_threads(threads)
+	PinThread(omp_get_thread_num(), threads);
+}
+
+/*!
+\brief Reallocate the layers from the threads of the team, see ScalarField2D::FirstTouch(). On NUMA machines,
+rows are then stored on the memory node of the thread that processes them in parallel loops over rows.
+*/
+void DuneSediment::DistributeStorage()
+{
+	const int threads = ThreadCount();
+	bedrock.FirstTouch(threads);
+	sediments.FirstTouch(threads);
+	vegetation.FirstTouch(threads);
+#if TERRAIN_INTERLEAVED
+	std::vector<TerrainCell, AlignedAllocator<TerrainCell>> touched;
+	touched.resize(cells.size());
+	const int size = int(cells.size());
+	const int blocks = (size + nx - 1) / nx;
+#pragma omp parallel for schedule(static) num_threads(threads)
+	for (int b = 0; b < blocks; b++)
+	{
+		const int end = Math::Min(size, (b + 1) * nx);
+		for (int k = b * nx; k < end; k++)
+			touched[k] = cells[k];
+	}
+	cells.swap(touched);
+#else
+	heights.FirstTouch(threads);
+#endif
+	if (shadows.SizeX() == nx && shadows.SizeY() == ny)
+		shadows.FirstTouch(threads);
+}
+
+/*!
+\brief Resize the per thread data and give every thread access to the whole grid.
+\param n number of threads
+*/
+void DuneSediment::ResetThreadData(int n)
+{
+	// Keep the pending bedrock modifications and the phase times of the threads that are removed
+	for (int i = n; i < int(threadData.size()); i++)
+	{
+		threadData[0].bedrockDirty.insert(threadData[0].bedrockDirty.end(), threadData[i].bedrockDirty.begin(), threadData[i].bedrockDirty.end());
+		threadData[0].lostSediment += threadData[i].lostSediment;
+		threadData[0].abradedBedrock += threadData[i].abradedBedrock;
+#if DUNE_PROFILE
+		for (int p = 0; p < PhaseCount; p++)
+			threadData[0].phaseSeconds[p] += threadData[i].phaseSeconds[p];
+#endif
+	}
+	threadData.resize(n);
+	for (int i = 0; i < n; i++)
+	{
+#if DUNE_COUNTERS
+		threadData[i].counters = SimulationCounters();
+#endif
+		ClearActiveCells(threadData[i]);
+		threadData[i].windowI = threadData[i].windowJ = 0;
+		threadData[i].windowNx = nx;
+		threadData[i].windowNy = ny;
+	}
+}
+
+/*!
+\brief Apply the changes recorded in the delta buffers of all threads, and clear the buffers. Chunks are
+processed in parallel, and the changes of a chunk are added in thread order, so the result does not
+depend on the scheduling of the reduction.
+*/
+void DuneSediment::ReduceDeltaBuffers()
+{
+	// Gather modified chunks, without duplicates
+	const int chunks = (bedrock.Storage() + 63) / 64;
+	deltaMarks.resize(chunks, 0);
+	deltaChunks.clear();
+	for (int t = 0; t < threadData.size(); t++)
+	{
+		const std::vector<int>& c = threadData[t].delta.chunks;
+		for (int k = 0; k < c.size(); k++)
+		{
+			if (deltaMarks[c[k]] == 0)
+			{
+				deltaMarks[c[k]] = 1;
+				deltaChunks.push_back(c[k]);
+			}
+		}
+	}
+
+	atomicWrites = false;
+#pragma omp parallel for num_threads(ThreadCount())
+	for (int k = 0; k < int(deltaChunks.size()); k++)
+	{
+		const int c = deltaChunks[k];
+		const int count = Math::Min(64, bedrock.Storage() - 64 * c);
+		for (int t = 0; t < threadData.size(); t++)
+		{
+			const DeltaBuffer& d = threadData[t].delta;
+			if (d.chunkOffset.size() <= c || d.chunkOffset[c] < 0)
+				continue;
+			const float* values = &d.values[d.chunkOffset[c]];
+			for (int l = 0; l < count; l++)
+			{
+				if (values[l] != 0.0f)
+					AddSediment(64 * c + l, values[l]);
+				if (values[64 + l] != 0.0f)
+					AddBedrock(64 * c + l, values[64 + l]);
+			}
+		}
+		deltaMarks[c] = 0;
+	}
+	atomicWrites = true;
+
+	// Clear buffers, keeping their storage
+	for (int t = 0; t < threadData.size(); t++)
+	{
+		DeltaBuffer& d = threadData[t].delta;
+		for (int k = 0; k < d.chunks.size(); k++)
+			d.chunkOffset[d.chunks[k]] = -1;
+		d.chunks.clear();
+		d.values.clear();
+	}
+}
+
 /*!
 \brief Some operations are performed every five iteration
 to improve computation time.
 */
 void DuneSediment::EndSimulationStep()
 {
-	static int simulationStepCount = 0;
+	stepCount++;
 
-#pragma omp atomic
-	simulationStepCount++;
+	// Concurrent atomic updates may have left cached heights out of date
+	if (heightsStale)
+	{
+		RefreshTerrainHeights();
+		heightsStale = false;
+	}
+
+	// Batched avalanches
+	if (relaxationPeriod > 0 && stepCount % relaxationPeriod == 0)
+		RelaxSediments(relaxationIterations, 0, 0, nx, ny);
 
-	if (simulationStepCount % 5 == 0)
+	if (stepCount % 5 == 0)
 	{
 		// Bedrock stabilization is required if abrasion is turned on
 		// To avoid unrealistic bedrock shapes. However, the repose angle of the material
-		// Can be changed (we use 68 degrees, see desert.h static variables).
+		// Can be changed (we use 68 degrees, see SimulationParams).
 		if (abrasionOn)
 			StabilizeBedrockAll();
 	}
+	FlushTerrainStore();
+
+	if (validationOn)
+		UpdateMassReport();
+}
+
+/*!
+\brief Measure the total sediment and bedrock, and count the negative cells. Rows are summed in parallel with
+compensated sums, and row sums are added in order, so that the result does not depend on the number of threads.
+*/
+MassReport DuneSediment::MeasureMass() const
+{
+	std::vector<CompensatedSum> sedimentRows(ny), bedrockRows(ny);
+	std::vector<int> negativeSedimentRows(ny, 0), negativeBedrockRows(ny, 0);
+	std::vector<float> minSedimentRows(ny, 0.0f);
+#pragma omp parallel for num_threads(ThreadCount())
+	for (int j = 0; j < ny; j++)
+	{
+		float m = Sediment(0, j);
+		for (int i = 0; i < nx; i++)
+		{
+			const float s = Sediment(i, j);
+			const float b = Bedrock(i, j);
+			sedimentRows[j].Add(s);
+			bedrockRows[j].Add(b);
+			negativeSedimentRows[j] += s < 0.0f ? 1 : 0;
+			negativeBedrockRows[j] += b < 0.0f ? 1 : 0;
+			m = Math::Min(m, s);
+		}
+		minSedimentRows[j] = m;
+	}
+
+	MassReport r;
+	CompensatedSum sediment, bedrock;
+	r.step = stepCount;
+	r.minSediment = ny > 0 ? minSedimentRows[0] : 0.0f;
+	for (int j = 0; j < ny; j++)
+	{
+		sediment.Add(sedimentRows[j]);
+		bedrock.Add(bedrockRows[j]);
+		r.negativeSediment += negativeSedimentRows[j];
+		r.negativeBedrock += negativeBedrockRows[j];
+		r.minSediment = Math::Min(r.minSediment, minSedimentRows[j]);
+	}
+	r.sediment = sediment.Value();
+	r.bedrock = bedrock.Value();
+	return r;
+}
+
+/*!
+\brief Take the current state of the simulation as the reference of the mass validation.
+*/
+void DuneSediment::ResetMassReport()
+{
+	for (int t = 0; t < threadData.size(); t++)
+		threadData[t].lostSediment = threadData[t].abradedBedrock = 0.0;
+	massReference = MeasureMass();
+	massReport = massReference;
+}
+
+/*!
+\brief Measure the mass balance after a step, see SetValidationMode().
+*/
+void DuneSediment::UpdateMassReport()
+{
+	massReport = MeasureMass();
+	for (int t = 0; t < threadData.size(); t++)
+	{
+		massReport.lostSediment += threadData[t].lostSediment;
+		massReport.abradedBedrock += threadData[t].abradedBedrock;
+	}
+	massReport.sedimentDrift = massReport.sediment - massReference.sediment + massReport.lostSediment;
+	massReport.bedrockDrift = massReport.bedrock - massReference.bedrock + massReport.abradedBedrock;
 }
 
 /*!
@@ -58,99 +1114,321 @@ a single simulation step at a random cell in the terrain.
 */
 void DuneSediment::SimulationStepWorldSpace()
 {
-	Vector2 windDir;
-
 	// (1) Select a random grid position (Lifting)
 	int startI = Random::Integer() % nx;
 	int startJ = Random::Integer() % ny;
+	SimulationStepWorldSpace(startI, startJ);
+}
+
+/*!
+\brief Performs a single simulation step starting at a given cell.
+\param startI, startJ start cell
+*/
+void DuneSediment::SimulationStepWorldSpace(int startI, int startJ)
+{
+	if (defaultParams)
+		SimulationEvent<true>(startI, startJ);
+	else
+		SimulationEvent<false>(startI, startJ);
+}
+
+/*!
+\brief Performs a single simulation step starting at a given cell, see SimulationStepWorldSpace().
+The default parameters are compile time constants in the Default version.
+\param startI, startJ start cell
+*/
+template<bool Default>
+void DuneSediment::SimulationEvent(int startI, int startJ)
+{
+	DUNE_PHASE(PhaseLift);
+	Vector2 windDir;
 	int start1D = ToIndex1D(startI, startJ);
+	const bool avalanches = !deferAvalanchesOn || relaxationPeriod <= 0;
 
 	// Compute wind at start cell
-	ComputeWindAtCell(startI, startJ, windDir);
+	WindAtCell(startI, startJ, windDir);
 
 	// No sediment to move
-	if (sediments.Get(start1D) <= 0.0)
+	DUNE_COUNT(events, 1);
+	if (SedimentAt(start1D) <= 0.0)
+	{
+		DUNE_COUNT(emptyExits, 1);
 		return;
+	}
 	// Wind shadowing probability
-	if (Random::Uniform() < IsInShadow(startI, startJ, windDir))
+	if (Random::Uniform() < ShadowAtCell(startI, startJ, windDir))
 	{
-		StabilizeSedimentRelative(startI, startJ);
+		DUNE_COUNT(shadowExits, 1);
+		if (avalanches)
+			StabilizeSedimentRelative<Default>(startI, startJ);
 		return;
 	}
 	// Vegetation can retain sediments in the lifting process
-	if (vegetationOn && Random::Uniform() < vegetation[start1D])
+	if (vegetationOn && Random::Uniform() < VegetationAt(start1D))
 	{
-		StabilizeSedimentRelative(startI, startJ);
+		DUNE_COUNT(vegetationExits, 1);
+		if (avalanches)
+			StabilizeSedimentRelative<Default>(startI, startJ);
 		return;
 	}
+	SaltationEvent<Default>(startI, startJ);
+}
+
+/*!
+\brief Lift a grain at a given cell, and move it by saltation until it is deposited.
+\param startI, startJ start cell
+*/
+template<bool Default>
+void DuneSediment::SaltationEvent(int startI, int startJ)
+{
+	const SimulationParams& p = Default ? defaultSimulationParams : params;
+	Vector2 windDir;
+	int start1D = ToIndex1D(startI, startJ);
+	const bool avalanches = !deferAvalanchesOn || relaxationPeriod <= 0;
 
 	// (2) Lift grain at start cell
-#pragma omp atomic
-	sediments[start1D] -= matterToMove;
+	AddSediment(start1D, -p.matterToMove);
+	DUNE_COUNT(lifted, 1);
+	DUNE_COUNT(saltationMass, p.matterToMove);
 
 	// (3) Jump downwind by saltation hop length (wind direction). Repeat until sand is deposited.
 	int destI = startI;
 	int destJ = startJ;
 	Vector2 pos = bedrock.ArrayVertex(destI, destJ);
 	int bounce = 0;
-	while (bounce < MAX_BOUNCE)
+	while (bounce < p.maxBounce)
 	{
+		DUNE_PHASE(PhaseSaltation);
 		// Compute wind at the current cell
-		ComputeWindAtCell(destI, destJ, windDir);
+		WindAtCell(destI, destJ, windDir);
 
 		// Compute new world position and new grid position (after wind addition)
 		pos = pos + windDir;
 		SnapWorld(pos);
 		bedrock.CellInteger(pos, destI, destJ);
 
-		// Conversion to 1D index to speed up computation
-		int destID = ToIndex1D(destI, destJ);
+		// Abrasion, deposition, or reptation and next bounce
+		if (SaltationBounce<Default>(start1D, destI, destJ, windDir, bounce))
+			break;
+	}
+	// End of the deposition loop - we have move matter from (startI, startJ) to (destI, destJ)
+	if (bounce >= p.maxBounce)
+		ThreadData().lostSediment += p.matterToMove;
+	DUNE_COUNT(deposited, bounce < p.maxBounce ? 1 : 0);
+	DUNE_COUNT(bounces[Math::Min(bounce, SimulationCounters::bounceBins - 1)], 1);
+
+	// Perform reptation at the deposition simulationStepCount
+	if (Random::Uniform() < 1.0 - VegetationAt(start1D))
+		PerformReptationOnCell<Default>(destI, destJ, bounce);
+
+	// Avalanches can be left to the relaxation pass
+	if (!avalanches)
+		return;
+
+	// (4) Check for the angle of repose on the original cell
+	StabilizeSedimentRelative<Default>(startI, startJ);
+
+	// (5) Check for the angle of repose on the destination cell if different
+	StabilizeSedimentRelative<Default>(destI, destJ);
+}
+
+/*!
+\brief Process a grain landing on a cell during saltation, see SaltationEvent(): abrasion of the bedrock, then
+deposition of the grain, or reptation if the grain bounces. Returns true if the grain is deposited.
+\param start1D lift cell of the grain
+\param destI, destJ landing cell
+\param windDir wind at the landing cell
+\param bounce number of bounces of the grain, incremented if it bounces
+*/
+template<bool Default>
+bool DuneSediment::SaltationBounce(int start1D, int destI, int destJ, const Vector2& windDir, int& bounce)
+{
+	const SimulationParams& p = Default ? defaultSimulationParams : params;
+	int destID = ToIndex1D(destI, destJ);
+
+	// Abrasion of the bedrock occurs with low sand supply, weak bedrock and a low probability.
+	if (abrasionOn && Random::Uniform() < p.abrasionProbability && SedimentAt(destID) < p.abrasionSediment)
+		PerformAbrasionOnCell<Default>(destI, destJ, windDir);
 
-		// Abrasion of the bedrock occurs with low sand supply, weak bedrock and a low probability.
-		if (abrasionOn && Random::Uniform() < 0.2 && sediments.Get(destID) < 0.5)
-			PerformAbrasionOnCell(destI, destJ, windDir);
+	// Probability of deposition
+	float u = Random::Uniform();
 
-		// Probability of deposition
-		float p = Random::Uniform();
+	// Shadowed cell
+	if (u < ShadowAtCell(destI, destJ, windDir))
+	{
+		AddSediment(destID, p.matterToMove);
+		return true;
+	}
+	// Sandy cell - 60% chance of deposition (if vegetation == 0.0)
+	else if (SedimentAt(destID) > 0.0 && u < p.sandDeposition + (vegetationOn ? (VegetationAt(destID) * p.sandVegetationDeposition) : 0.0f))
+	{
+		AddSediment(destID, p.matterToMove);
+		return true;
+	}
+	// Empty cell - 40% chance of deposition (if vegetation == 0.0)
+	else if (SedimentAt(destID) <= 0.0 && u < p.bedrockDeposition + (vegetationOn ? (VegetationAt(destID) * p.bedrockVegetationDeposition) : 0.0f))
+	{
+		AddSediment(destID, p.matterToMove);
+		return true;
+	}
+
+	// Perform reptation at each bounce
+	bounce++;
+	if (Random::Uniform() < 1.0 - VegetationAt(start1D))
+		PerformReptationOnCell<Default>(destI, destJ, bounce);
+	return false;
+}
 
-		// Shadowed cell
-		if (p < IsInShadow(destI, destJ, windDir))
+/*!
+\brief Performs simulation events for a batch of grains lifted at random cells of a region. Grains go
+through the same process as in SimulationStepWorldSpace(), but each phase is performed for all the
+grains of the batch before the next one: lift, then every bounce, then reptation and stabilization at the
+deposition cells. Bounces are processed by SaltationBounce(), as for single grains.
+\param firstI, firstJ first cell of the region
+\param sizeI, sizeJ size of the region
+\param count number of grains
+*/
+void DuneSediment::SimulationStepBatch(int firstI, int firstJ, int sizeI, int sizeJ, int count)
+{
+	if (defaultParams)
+		SimulationBatch<true>(firstI, firstJ, sizeI, sizeJ, count);
+	else
+		SimulationBatch<false>(firstI, firstJ, sizeI, sizeJ, count);
+}
+
+/*!
+\brief Performs simulation events for a batch of grains, see SimulationStepBatch(). The default parameters are
+compile time constants in the Default version.
+\param firstI, firstJ first cell of the region
+\param sizeI, sizeJ size of the region
+\param count number of grains
+*/
+template<bool Default>
+void DuneSediment::SimulationBatch(int firstI, int firstJ, int sizeI, int sizeJ, int count)
+{
+	const SimulationParams& params = Default ? defaultSimulationParams : this->params;
+	DUNE_PHASE(PhaseLift);
+	GrainBatch& g = ThreadData().batch;
+	if (int(g.startI.size()) < count)
+	{
+		g.startI.resize(count); g.startJ.resize(count);
+		g.destI.resize(count); g.destJ.resize(count);
+		g.x.resize(count); g.y.resize(count);
+		g.windX.resize(count); g.windY.resize(count);
+		g.bounce.resize(count);
+		g.alive.resize(count);
+		g.lifted.resize(count);
+	}
+	const bool avalanches = !deferAvalanchesOn || relaxationPeriod <= 0;
+
+	// (1) Select random grid positions, among the active cells if any: the batch ends with the draws
+	DuneThreadData& td = ThreadData();
+	for (int k = 0; k < count; k++)
+	{
+		if (td.activeNx > 0)
 		{
-#pragma omp atomic
-			sediments[destID] += matterToMove;
-			break;
+			if (!NextActiveCell(td, g.startI[k], g.startJ[k]))
+				count = k;
 		}
-		// Sandy cell - 60% chance of deposition (if vegetation == 0.0)
-		else if (sediments.Get(destID) > 0.0 && p < 0.6 + (vegetationOn ? (vegetation.Get(destID) * 0.4) : 0.0))
+		else
 		{
-#pragma omp atomic
-			sediments[destID] += matterToMove;
-			break;
+			g.startI[k] = firstI + Random::Integer() % sizeI;
+			g.startJ[k] = firstJ + Random::Integer() % sizeJ;
+		}
+	}
+	for (int k = 0; k < count; k++)
+	{
+		Vector2 w;
+		WindAtCell(g.startI[k], g.startJ[k], w);
+		g.windX[k] = w[0];
+		g.windY[k] = w[1];
+	}
+
+	// (2) Lift grains, unless there is no sediment, or it is retained by wind shadow or vegetation
+	int alive = 0;
+	for (int k = 0; k < count; k++)
+	{
+		const int start1D = ToIndex1D(g.startI[k], g.startJ[k]);
+		g.lifted[k] = 0;
+		g.alive[k] = 0;
+		DUNE_COUNT(events, 1);
+		if (SedimentAt(start1D) <= 0.0)
+		{
+			DUNE_COUNT(emptyExits, 1);
+			continue;
 		}
-		// Empty cell - 40% chance of deposition (if vegetation == 0.0)
-		else if (sediments.Get(destID) <= 0.0 && p < 0.4 + (vegetationOn ? (vegetation.Get(destID) * 0.6) : 0.0))
+		const bool shadowed = Random::Uniform() < ShadowAtCell(g.startI[k], g.startJ[k], Vector2(g.windX[k], g.windY[k]));
+		if (shadowed || (vegetationOn && Random::Uniform() < VegetationAt(start1D)))
 		{
-#pragma omp atomic
-			sediments[destID] += matterToMove;
-			break;
+			DUNE_COUNT(shadowExits, shadowed ? 1 : 0);
+			DUNE_COUNT(vegetationExits, shadowed ? 0 : 1);
+			if (avalanches)
+				StabilizeSedimentRelative<Default>(g.startI[k], g.startJ[k]);
+			continue;
 		}
-
-		// Perform reptation at each bounce
-		bounce++;
-		if (Random::Uniform() < 1.0 - vegetation[start1D])
-			PerformReptationOnCell(destI, destJ, bounce);
+		AddSediment(start1D, -params.matterToMove);
+		const Vector2 pos = bedrock.ArrayVertex(g.startI[k], g.startJ[k]);
+		g.x[k] = pos[0];
+		g.y[k] = pos[1];
+		g.destI[k] = g.startI[k];
+		g.destJ[k] = g.startJ[k];
+		g.bounce[k] = 0;
+		g.lifted[k] = 1;
+		g.alive[k] = 1;
+		alive++;
+		DUNE_COUNT(lifted, 1);
+		DUNE_COUNT(saltationMass, params.matterToMove);
 	}
-	// End of the deposition loop - we have move matter from (startI, startJ) to (destI, destJ)
 
-	// Perform reptation at the deposition simulationStepCount
-	if (Random::Uniform() < 1.0 - vegetation[start1D])
-		PerformReptationOnCell(destI, destJ, bounce);
+	// (3) Jump downwind, all moving grains together, until they are deposited
+	for (int bounce = 0; bounce < params.maxBounce && alive > 0; bounce++)
+	{
+		DUNE_PHASE(PhaseSaltation);
+		// Move grains
+		for (int k = 0; k < count; k++)
+		{
+			if (g.alive[k] == 0)
+				continue;
+			Vector2 w;
+			WindAtCell(g.destI[k], g.destJ[k], w);
+			Vector2 pos = Vector2(g.x[k], g.y[k]) + w;
+			SnapWorld(pos);
+			bedrock.CellInteger(pos, g.destI[k], g.destJ[k]);
+			g.x[k] = pos[0];
+			g.y[k] = pos[1];
+			g.windX[k] = w[0];
+			g.windY[k] = w[1];
+		}
 
-	// (4) Check for the angle of repose on the original cell
-	StabilizeSedimentRelative(startI, startJ);
+		// Abrasion, deposition, or reptation and next bounce
+		for (int k = 0; k < count; k++)
+		{
+			if (g.alive[k] == 0)
+				continue;
+			if (SaltationBounce<Default>(ToIndex1D(g.startI[k], g.startJ[k]), g.destI[k], g.destJ[k], Vector2(g.windX[k], g.windY[k]), g.bounce[k]))
+			{
+				DUNE_COUNT(deposited, 1);
+				g.alive[k] = 0;
+				alive--;
+			}
+		}
+	}
+	ThreadData().lostSediment += double(alive) * params.matterToMove;
 
-	// (5) Check for the angle of repose on the destination cell if different
-	StabilizeSedimentRelative(destI, destJ);
+	// (4) Reptation at the deposition cells, and angle of repose on the original and destination cells
+	for (int k = 0; k < count; k++)
+	{
+		if (g.lifted[k] == 0)
+			continue;
+		DUNE_COUNT(bounces[Math::Min(int(g.bounce[k]), SimulationCounters::bounceBins - 1)], 1);
+		if (Random::Uniform() < 1.0 - VegetationAt(ToIndex1D(g.startI[k], g.startJ[k])))
+			PerformReptationOnCell<Default>(g.destI[k], g.destJ[k], g.bounce[k]);
+		if (avalanches)
+		{
+			StabilizeSedimentRelative<Default>(g.startI[k], g.startJ[k]);
+			StabilizeSedimentRelative<Default>(g.destI[k], g.destJ[k]);
+		}
+	}
 }
 
 /*!
@@ -159,19 +1437,22 @@ Although some observations have been made in geomorphology about the impact
 of reptation, we didn't find any particular change with or without reptation activated.
 Still, implementation is provided if someone wants to try it.
 */
+template<bool Default>
 void DuneSediment::PerformReptationOnCell(int i, int j, int bounce)
 {
+	DUNE_PHASE(PhaseReptation);
+	const SimulationParams& params = Default ? defaultSimulationParams : this->params;
 	// Compute amount of sand to creep; function of number of bounce.
 	int b = Math::Clamp(bounce, 0, 3);
 	float t = float(b) / 3.0f;
-	float se = Math::Lerp(matterToMove / 2.0f, matterToMove, t);
-	float rReptationSquared = 2.0 * 2.0;
+	float se = Math::Lerp(params.matterToMove / 2.0f, params.matterToMove, t);
+	float rReptationSquared = params.reptationRadius * params.reptationRadius;
 	Vector2 p = bedrock.ArrayVertex(i, j);
 
 	// Distribute sand at the 2-steepest neighbours
 	Vector2i nei[8];
 	float nslope[8];
-	int n = Math::Min(2, CheckSedimentFlowRelative(Vector2i(i, j), tanThresholdAngleSediment, nei, nslope));
+	int n = Math::Min(2, CheckSedimentFlowRelative(Vector2i(i, j), params.tanThresholdAngleSediment, nei, nslope));
 	int nEffective = 0;
 	for (int k = 0; k < n; k++)
 	{
@@ -185,8 +1466,7 @@ void DuneSediment::PerformReptationOnCell(int i, int j, int bounce)
 			continue;
 
 		// Distribute sediment to neighbour
-#pragma omp atomic
-		sediments[ToIndex1D(next)] += sei;
+		AddSediment(ToIndex1D(next), sei);
 
 		// Count the amount of neighbour which received sand from the current cell (i, j)
 		nEffective++;
@@ -195,11 +1475,42 @@ void DuneSediment::PerformReptationOnCell(int i, int j, int bounce)
 	// Remove sediment at the current cell
 	if (n > 0 && nEffective > 0)
 	{
-#pragma omp atomic
-		sediments[ToIndex1D(i, j)] -= se;
+		AddSediment(ToIndex1D(i, j), -se);
+		DUNE_COUNT(reptationMass, se);
 	}
 }
 
+/*!
+\brief Compute the gradient of the sediment layer at a given cell, see ScalarField2D::Gradient().
+\param i, j cell
+*/
+Vector2 DuneSediment::SedimentGradient(int i, int j) const
+{
+#if TERRAIN_INTERLEAVED
+	Vector2 ret;
+
+	// X Gradient
+	if (i == 0)
+		ret.x = (SedimentAt(ToIndex1D(i + 1, j)) - SedimentAt(ToIndex1D(i, j))) / cellSize;
+	else if (i == nx - 1)
+		ret.x = (SedimentAt(ToIndex1D(i, j)) - SedimentAt(ToIndex1D(i - 1, j))) / cellSize;
+	else
+		ret.x = (SedimentAt(ToIndex1D(i + 1, j)) - SedimentAt(ToIndex1D(i - 1, j))) / (2.0f * cellSize);
+
+	// Y Gradient
+	if (j == 0)
+		ret.y = (SedimentAt(ToIndex1D(i, j + 1)) - SedimentAt(ToIndex1D(i, j))) / cellSize;
+	else if (j == ny - 1)
+		ret.y = (SedimentAt(ToIndex1D(i, j)) - SedimentAt(ToIndex1D(i, j - 1))) / cellSize;
+	else
+		ret.y = (SedimentAt(ToIndex1D(i, j + 1)) - SedimentAt(ToIndex1D(i, j - 1))) / (2.0f * cellSize);
+
+	return ret;
+#else
+	return sediments.Gradient(i, j);
+#endif
+}
+
 /*!
 \brief Compute the wind direction at a given cell.
 \param i cell coordinate
@@ -212,7 +1523,7 @@ void DuneSediment::ComputeWindAtCell(int i, int j, Vector2& windDir) const
 	windDir = wind;
 
 	// Modulate wind strength with sediment layer: increase velocity on slope in the direction of the wind
-	Vector2 g = sediments.Gradient(i, j);
+	Vector2 g = SedimentGradient(i, j);
 	float similarity = 0.0f;
 	float slope = 0.0f;
 	if (g != Vector2(0.0f) && windDir != Vector2(0.0f))
@@ -226,6 +1537,31 @@ void DuneSediment::ComputeWindAtCell(int i, int j, Vector2& windDir) const
 	windDir = Math::Lerp(windDir, 2.0f * windDir, t);
 }
 
+/*!
+\brief Compute the wind of every cell, see ComputeWindAtCell().
+*/
+void DuneSediment::UpdateWindField()
+{
+	windField.resize(2 * size_t(bedrock.Storage()));
+#pragma omp parallel for num_threads(ThreadCount())
+	for (int j = 0; j < ny; j++)
+	{
+		for (int i = 0; i < nx; i++)
+		{
+			Vector2 w;
+			ComputeWindAtCell(i, j, w);
+			const int id = 2 * ToIndex1D(i, j);
+#if WIND_FIELD_HALF
+			windField[id] = Math::FloatToHalf(w[0]);
+			windField[id + 1] = Math::FloatToHalf(w[1]);
+#else
+			windField[id] = w[0];
+			windField[id + 1] = w[1];
+#endif
+		}
+	}
+}
+
 /*!
 \brief This functions performs the abrasion algorithm described in the paper,
 which is responsible for the creation of yardang features.
@@ -233,34 +1569,41 @@ which is responsible for the creation of yardang features.
 \param j cell j
 \param windDir wind direction at this cell
 */
+template<bool Default>
 void DuneSediment::PerformAbrasionOnCell(int i, int j, const Vector2& windDir)
 {
+	DUNE_PHASE(PhaseAbrasion);
+	const SimulationParams& params = Default ? defaultSimulationParams : this->params;
 	int id = ToIndex1D(i, j);
 
 	// Vegetation protects from abrasion
-	float v = vegetationOn ? vegetation.Get(id) : 0.0f;
+	float v = vegetationOn ? VegetationAt(id) : 0.0f;
 
 	// Bedrock resistance [0, 1] (1.0 equals to weak, 0.0 equals to hard)
 	// Here with a simple sin() function, but anything could be used: texture, noise, construction trees...
 	// In the paper, we used various noises octaves combined with each other.
 	// Note: To get a more interesting look on the yardangs, turbulent wind is required. It is not provided
 	// In this implementation.
+	// Stripes vary along the x axis, across the winds of the scenes which blow along y.
 	const Vector2 p = bedrock.ArrayVertex(i, j);
 	const float freq = 0.08f;
 	const float warp = 15.36f;
-	float h = (sinf((p.y * freq) + (warp * PerlinNoise::GetValue(0.05f * p))) + 1.0f) / 2.0f;
+	float h = (sinf((p.x * freq) + (warp * PerlinNoise::GetValue(0.05f * Vector2(p.y, p.x)))) + 1.0f) / 2.0f;
 
 	// Wind strength
 	float w = Math::Clamp(Magnitude(windDir), 0.0f, 2.0f);
 
 	// Abrasion strength, function of vegetation, hardness and wind speed.
-	float si = abrasionEpsilon * (1.0f - v) * (1.0f - h) * w;
+	float si = params.abrasionEpsilon * (1.0f - v) * (1.0f - h) * w;
 	if (si == 0.0)
 		return;
 
 	// Transform bedrock into dust
-#pragma omp atomic
-	bedrock[id] -= si;
+	AddBedrock(id, -si);
+	ThreadData().abradedBedrock += si;
+	DUNE_COUNT(abrasions, 1);
+	DUNE_COUNT(abrasionMass, si);
+	ThreadData().bedrockDirty.push_back(Vector2i(i, j));
 }
 
 /*!
@@ -273,6 +1616,7 @@ Use the threshold angle described in geomorphology papers, ie. ~[5, 15]
 */
 float DuneSediment::IsInShadow(int i, int j, const Vector2& windDir) const
 {
+	DUNE_PHASE(PhaseShadow);
 	const float windStepLength = 1.0;
 	const Vector2 windStep = Vector2(
 		windDir[0] > 0.0f ? windStepLength : windDir[0] < 0.0f ? -windStepLength : 0.0f,
@@ -280,7 +1624,7 @@ float DuneSediment::IsInShadow(int i, int j, const Vector2& windDir) const
 	);
 	Vector2 p = bedrock.ArrayVertex(i, j);
 	Vector2 pShadow = p;
-	float rShadow = 10.0f;
+	float rShadow = params.shadowRadius;
 	float hp = Height(p);
 	float ret = 0.0;
 	while (true)
@@ -297,23 +1641,46 @@ float DuneSediment::IsInShadow(int i, int j, const Vector2& windDir) const
 
 		float step = Height(pShadowSnapped) - hp;
 		float t = (step / d);
-		float s = Math::Step(t, tanThresholdAngleWindShadowMin, tanThresholdAngleWindShadowMax);
+		float s = Math::Step(t, params.tanThresholdAngleWindShadowMin, params.tanThresholdAngleWindShadowMax);
 		ret = Math::Max(ret, s);
+
+		// Fully in shadow, farther samples cannot change the result
+		if (ret >= 1.0f)
+			break;
 	}
 	return ret;
 }
 
+/*!
+\brief Compute the wind shadow of every cell for the direction of the base wind. The shadow only depends
+on the sign of the wind components, which the local wind modulation does not change.
+*/
+void DuneSediment::UpdateShadowField()
+{
+	if (shadows.SizeX() != nx || shadows.SizeY() != ny)
+		shadows = ScalarField2D(nx, ny, box, 0.0);
+#pragma omp parallel for num_threads(ThreadCount())
+	for (int j = 0; j < ny; j++)
+	{
+		for (int i = 0; i < nx; i++)
+			shadows.Set(i, j, IsInShadow(i, j, wind));
+	}
+}
+
 /*!
 \brief Snaps the coordinates of a given point to stay within terrain boundaries.
 */
 void DuneSediment::SnapWorld(Vector2& p) const
 {
-	if (p[0] < 0)
-		p[0] = box.Size()[0] + p[0];
-	else if (p[0] >= box.Size()[0])
-		p[0] = p[0] - box.Size()[0];
-	if (p[1] < 0)
-		p[1] = box.Size()[1] + p[1];
-	else if (p[1] >= box.Size()[1])
-		p[1] = p[1] - box.Size()[1];
+	const Vector2 a = box.BottomLeft();
+	const Vector2 b = box.TopRight();
+	const Vector2 s = box.Size();
+	if (p[0] < a[0])
+		p[0] = p[0] + s[0];
+	else if (p[0] >= b[0])
+		p[0] = p[0] - s[0];
+	if (p[1] < a[1])
+		p[1] = p[1] + s[1];
+	else if (p[1] >= b[1])
+		p[1] = p[1] - s[1];
 }
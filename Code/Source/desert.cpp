@@ -3,10 +3,59 @@
 
 #include <iostream>
 #include <fstream>
+#include <climits>
+#include <cstring>
+#include <type_traits>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+// Header of a binary snapshot, see DuneSediment::SaveSnapshot(). Layers follow, stored raw in the memory
+// layout of ScalarField2D, at offsets aligned on 64 KB so that they can be memory mapped on any platform.
+struct SnapshotHeader
+{
+	char magic[8];					//!< DUNESNAP.
+	uint32_t version;				//!< Format version.
+	uint32_t layout;				//!< Memory layout of the layers, see SCALAR_FIELD_TILED.
+	int32_t nx, ny;					//!< Grid resolution.
+	uint64_t storage;				//!< Number of values of a layer, including padding.
+	float box[4];					//!< Bounding box, bottom left and top right corners.
+	float wind[2];					//!< Base wind.
+	uint64_t seed;					//!< Run seed.
+	int32_t stepCount;				//!< Number of steps performed.
+	uint32_t flags;					//!< Simulation modes, see SnapshotFlags.
+	int32_t relaxationPeriod;		//!< Relaxation pass period.
+	int32_t relaxationIterations;	//!< Relaxation pass iterations.
+	int32_t batchSize;				//!< Saltation batch size.
+	int32_t bedrockDirtyAll;		//!< Whether the whole bedrock should be stabilized.
+	SimulationParams params;		//!< Physical parameters.
+	int32_t streamTileSize;			//!< Tile size of the out of core simulation, zero if off.
+	uint64_t layerOffset[3];		//!< Offsets of the bedrock, sediment and vegetation layers.
+	uint64_t dirtyOffset;			//!< Offset of the cells whose bedrock changed since the last stabilization.
+	uint64_t dirtyCount;			//!< Number of such cells, stored as pairs of int32.
+};
+static_assert(sizeof(SnapshotHeader) == 192, "Snapshot header layout changed");
+static_assert(std::is_trivially_copyable<SnapshotHeader>::value, "Snapshot header is written and mapped as raw bytes");
+
+enum SnapshotFlags
+{
+	SnapshotVegetation = 1,
+	SnapshotAbrasion = 2,
+	SnapshotDeterministic = 4,
+	SnapshotShadowCache = 8,
+	SnapshotWindCache = 16,
+	SnapshotDeferAvalanches = 32,
+	SnapshotDeltaBuffers = 64,
+	SnapshotActiveCells = 128,
+	SnapshotKinetic = 256,
+};
+
+static const uint64_t snapshotAlignment = 65536;
+static uint64_t SnapshotAlign(uint64_t offset)
+{
+	return (offset + snapshotAlignment - 1) / snapshotAlignment * snapshotAlignment;
+}
+
 
 /*!
 \brief Default constructor.
@@ -16,32 +65,92 @@ DuneSediment::DuneSediment()
 	nx = ny = 256;
 	box = Box2D(Vector2(0), 1);
 	wind = Vector2(1, 0);
+	seed = 0;
+	stepCount = 0;
 
 	bedrock = ScalarField2D(nx, ny, box, 0.0);
 	vegetation = ScalarField2D(nx, ny, box, 0.0);
 	sediments = ScalarField2D(nx, ny, box, 0.0);
-
-	matterToMove = 0.1f;
+	BuildTerrainStore();
+	ResetThreadData(1);
+	bedrockDirtyAll = true;
 	Vector2 celldiagonal = Vector2((box.TopRight()[0] - box.BottomLeft()[0]) / (nx - 1), (box.TopRight()[1] - box.BottomLeft()[1]) / (ny - 1));
 	cellSize = Box2D(box.BottomLeft(), box.BottomLeft() + celldiagonal).Size().x; // We only consider squared heightfields
 }
 
+/*!
+\brief Constructor, with a 256x256 grid.
+\param bbox 2D bounding box
+\param rMin min amount of sediment per cell
+\param rMax max amount of sediment per cell
+\param w wind vector
+\param s run seed
+*/
+DuneSediment::DuneSediment(const Box2D& bbox, float rMin, float rMax, const Vector2& w, uint64_t s) : DuneSediment(bbox, 256, 256, rMin, rMax, w, s)
+{
+}
+
+/*!
+\brief Constructor, with square cells of a given size. The domain starts at the origin.
+\param nx, ny grid resolution
+\param size cell size, in meter
+\param rMin min amount of sediment per cell
+\param rMax max amount of sediment per cell
+\param w wind vector
+\param s run seed
+*/
+DuneSediment::DuneSediment(int nx, int ny, float size, float rMin, float rMax, const Vector2& w, uint64_t s)
+	: DuneSediment(Box2D(Vector2(0), Vector2(float(nx - 1) * size, float(ny - 1) * size)), nx, ny, rMin, rMax, w, s)
+{
+}
+
+/*!
+\brief Constructor of a flat simulation without sediment nor vegetation, with cells of 1 meter. Nothing else is
+computed, the layers being filled by the caller, as the windows of the streamed step, see LoadWindow().
+\param resX, resY grid resolution
+*/
+DuneSediment::DuneSediment(int resX, int resY)
+{
+	box = Box2D(Vector2(0), Vector2(float(resX - 1), float(resY - 1)));
+	nx = resX;
+	ny = resY;
+	cellSize = 1.0f;
+	wind = Vector2(0);
+	seed = 0;
+	stepCount = 0;
+
+	bedrock = ScalarField2D(nx, ny, box, 0.0);
+	vegetation = ScalarField2D(nx, ny, box, 0.0);
+	sediments = ScalarField2D(nx, ny, box, 0.0);
+	BuildTerrainStore();
+	ResetThreadData(1);
+	bedrockDirtyAll = true;
+}
+
 /*!
 \brief Constructor.
 \param bbox 2D bounding box
+\param resX, resY grid resolution
 \param rMin min amount of sediment per cell
 \param rMax max amount of sediment per cell
 \param w wind vector
+\param s run seed
 */
-DuneSediment::DuneSediment(const Box2D& bbox, float rMin, float rMax, const Vector2& w)
+DuneSediment::DuneSediment(const Box2D& bbox, int resX, int resY, float rMin, float rMax, const Vector2& w, uint64_t s)
 {
 	box = bbox;
-	nx = ny = 256;
+	nx = resX;
+	ny = resY;
 	wind = w;
+	seed = s;
+	stepCount = 0;
 
 	bedrock = ScalarField2D(nx, ny, box, 0.0);
 	vegetation = ScalarField2D(nx, ny, box, 0.0);
 	sediments = ScalarField2D(nx, ny, box, 0.0);
+	ResetThreadData(1);
+	bedrockDirtyAll = true;
+	Random::Seed(seed, 0);
 	for (int i = 0; i < nx; i++)
 	{
 		for (int j = 0; j < ny; j++)
@@ -58,15 +167,15 @@ DuneSediment::DuneSediment(const Box2D& bbox, float rMin, float rMax, const Vect
 			sediments.Set(i, j, Random::Uniform(rMin, rMax));
 		}
 	}
+	BuildTerrainStore();
 	
 	// By default, vegetation influence and abrasion are turned off.
 	vegetationOn = false;
 	abrasionOn = false;
+	deterministicOn = false;
 
-	Vector2 celldiagonal = Vector2((box.TopRight()[0] - box.BottomLeft()[0]) / (nx - 1), (box.TopRight()[1] - box.BottomLeft()[1]) / (ny - 1));
-	cellSize = Box2D(box.BottomLeft(), box.BottomLeft() + celldiagonal).Size().x; // We only consider squared heightfields
-
-	matterToMove = 0.1f;
+	// Cells are assumed to be square, the size of the domain along y should match the resolution.
+	cellSize = box.Size().x / (nx - 1);
 }
 
 /*!
@@ -77,6 +186,112 @@ DuneSediment::~DuneSediment()
 
 }
 
+/*!
+\brief Initialize the terrain store from the layer fields.
+*/
+void DuneSediment::BuildTerrainStore()
+{
+#if TERRAIN_INTERLEAVED
+	cells.resize(bedrock.Storage());
+	for (int id = 0; id < bedrock.Storage(); id++)
+	{
+		cells[id].bedrock = bedrock.Get(id);
+		cells[id].sediment = sediments.Get(id);
+		cells[id].vegetation = vegetation.Get(id);
+		cells[id].height = cells[id].bedrock + cells[id].sediment;
+	}
+#else
+	heights = ScalarField2D(nx, ny, box);
+	for (int id = 0; id < bedrock.Storage(); id++)
+		heights.Set(id, bedrock.Get(id) + sediments.Get(id));
+#endif
+	terrainStoreOn = true;
+}
+
+/*!
+\brief Free the terrain store, the layer fields being up to date. The store is built again by the next
+step, see BeginSimulationStep(), so that restoring a mapped snapshot neither reads all the cells nor
+allocates them on the heap.
+*/
+void DuneSediment::ReleaseTerrainStore()
+{
+#if TERRAIN_INTERLEAVED
+	std::vector<TerrainCell, AlignedAllocator<TerrainCell>>().swap(cells);
+#else
+	heights = ScalarField2D();
+#endif
+	terrainStoreOn = false;
+}
+
+/*!
+\brief Recompute the cached heights of the terrain store from the bedrock and sediment layers of the store.
+Called at the end of the steps whose threads updated the same cells concurrently. Only the cells recorded by
+the threads are refreshed, unless a thread recorded more than its limit, see RecordTouched(). Cells are no
+longer recorded afterwards.
+*/
+void DuneSediment::RefreshTerrainHeights()
+{
+	const int threads = int(threadData.size());
+	bool all = false;
+	for (int t = 0; t < threads; t++)
+		all = all || int(threadData[t].touched.size()) > touchedLimit;
+	if (all)
+	{
+#pragma omp parallel for num_threads(threads)
+		for (int id = 0; id < bedrock.Storage(); id++)
+			RefreshTerrainHeight(id);
+	}
+	else
+	{
+		// Cells recorded by several threads get the same height from each of them
+#pragma omp parallel for num_threads(threads)
+		for (int t = 0; t < threads; t++)
+		{
+			const std::vector<int>& touched = threadData[t].touched;
+			for (int k = 0; k < int(touched.size()); k++)
+				RefreshTerrainHeight(touched[k]);
+		}
+	}
+	for (int t = 0; t < threads; t++)
+		threadData[t].touched.clear();
+	touchedLimit = 0;
+}
+
+/*!
+\brief Recompute the cached height of a cell of the terrain store.
+\param id cell index
+*/
+inline void DuneSediment::RefreshTerrainHeight(int id)
+{
+#if TERRAIN_INTERLEAVED
+	const float h = cells[id].bedrock + cells[id].sediment;
+#pragma omp atomic write
+	cells[id].height = h;
+#else
+	const float h = bedrock[id] + sediments[id];
+#pragma omp atomic write
+	heights[id] = h;
+#endif
+}
+
+/*!
+\brief Copy the terrain store back to the layer fields. Called at the end of each step, the layer
+fields are otherwise out of date with the interleaved store. Nothing to do with separate arrays.
+*/
+void DuneSediment::FlushTerrainStore()
+{
+#if TERRAIN_INTERLEAVED
+	if (!terrainStoreOn)
+		return;
+#pragma omp parallel for num_threads(ThreadCount())
+	for (int id = 0; id < bedrock.Storage(); id++)
+	{
+		bedrock.Set(id, cells[id].bedrock);
+		sediments.Set(id, cells[id].sediment);
+	}
+#endif
+}
+
 /*!
 \brief Export the current dune model as an obj file representing the full heightfield.
 \param url file path
@@ -95,7 +310,7 @@ void DuneSediment::ExportObj(const std::string& url) const
 	{
 		for (int j = 0; j < ny; j++)
 		{
-			int id = ToIndex1D(i, j);
+			int id = j * nx + i;
 			normals[id] = -Normalize(Vector2(bedrock.Gradient(i, j) + sediments.Gradient(i, j)).ToVector3(-2.0f));
 			vertices[id] = Vector3(
 				box[0][0] + i * (box[1][0] - box[0][0]) / (nx - 1),
@@ -166,3 +381,396 @@ void DuneSediment::ExportJPG(const std::string& url) const
 	}
 	stbi_write_jpg(url.c_str(), nx, ny, 3, pixels, 98);
 }
+
+/*!
+\brief Fill the state of the simulation in a snapshot header, layer and dirty list offsets excepted, and
+gather the pending bedrock modifications.
+\param header snapshot header
+\param dirty cells whose bedrock changed since the last stabilization, as pairs of coordinates
+*/
+void DuneSediment::SnapshotState(SnapshotHeader& header, std::vector<int32_t>& dirty) const
+{
+	header = SnapshotHeader();
+	memcpy(header.magic, "DUNESNAP", 8);
+	header.version = 1;
+	header.layout = SCALAR_FIELD_TILED;
+	header.nx = nx;
+	header.ny = ny;
+	header.storage = uint64_t(bedrock.Storage());
+	header.box[0] = box.BottomLeft()[0];
+	header.box[1] = box.BottomLeft()[1];
+	header.box[2] = box.TopRight()[0];
+	header.box[3] = box.TopRight()[1];
+	header.wind[0] = wind[0];
+	header.wind[1] = wind[1];
+	header.seed = seed;
+	header.stepCount = stepCount;
+	header.flags = (vegetationOn ? SnapshotVegetation : 0) | (abrasionOn ? SnapshotAbrasion : 0) |
+		(deterministicOn ? SnapshotDeterministic : 0) | (shadowCacheOn ? SnapshotShadowCache : 0) |
+		(windCacheOn ? SnapshotWindCache : 0) | (deferAvalanchesOn ? SnapshotDeferAvalanches : 0) |
+		(deltaBuffersOn ? SnapshotDeltaBuffers : 0) | (activeCellsOn ? SnapshotActiveCells : 0) |
+		(kineticOn ? SnapshotKinetic : 0);
+	header.relaxationPeriod = relaxationPeriod;
+	header.relaxationIterations = relaxationIterations;
+	header.batchSize = batchSize;
+	header.streamTileSize = streamTileSize;
+	header.bedrockDirtyAll = bedrockDirtyAll ? 1 : 0;
+	header.params = params;
+
+	// Pending bedrock modifications, in thread order, then those of the streamed step in cell order
+	dirty.clear();
+	for (int t = 0; t < threadData.size(); t++)
+	{
+		for (int k = 0; k < threadData[t].bedrockDirty.size(); k++)
+		{
+			dirty.push_back(threadData[t].bedrockDirty[k].x);
+			dirty.push_back(threadData[t].bedrockDirty[k].y);
+		}
+	}
+	for (int w = 0; w < bedrockDirtyBits.size(); w++)
+	{
+		for (int b = 0; b < 64 && bedrockDirtyBits[w] >> b != 0; b++)
+		{
+			if ((bedrockDirtyBits[w] >> b) & 1)
+			{
+				int i, j;
+				bedrock.ToIndex2D(w * 64 + b, i, j);
+				dirty.push_back(i);
+				dirty.push_back(j);
+			}
+		}
+	}
+}
+
+/*!
+\brief Restore the state of the simulation from a snapshot header. Layers are moved, so that mapped layers
+remain mapped, and the terrain store is only built by the next step.
+\param header snapshot header
+\param layers bedrock, sediment and vegetation layers
+\param dirty cells whose bedrock changed since the last stabilization, as pairs of coordinates
+*/
+void DuneSediment::RestoreSnapshotState(const SnapshotHeader& header, ScalarField2D* layers, const std::vector<int32_t>& dirty)
+{
+	box = layers[0].GetBox();
+	nx = header.nx;
+	ny = header.ny;
+	cellSize = box.Size().x / (nx - 1);
+	wind = Vector2(header.wind[0], header.wind[1]);
+	seed = header.seed;
+	stepCount = header.stepCount;
+	vegetationOn = (header.flags & SnapshotVegetation) != 0;
+	abrasionOn = (header.flags & SnapshotAbrasion) != 0;
+	deterministicOn = (header.flags & SnapshotDeterministic) != 0;
+	shadowCacheOn = (header.flags & SnapshotShadowCache) != 0;
+	windCacheOn = (header.flags & SnapshotWindCache) != 0;
+	deferAvalanchesOn = (header.flags & SnapshotDeferAvalanches) != 0;
+	deltaBuffersOn = (header.flags & SnapshotDeltaBuffers) != 0;
+	activeCellsOn = (header.flags & SnapshotActiveCells) != 0;
+	kineticOn = (header.flags & SnapshotKinetic) != 0;
+	relaxationPeriod = header.relaxationPeriod;
+	relaxationIterations = header.relaxationIterations;
+	batchSize = header.batchSize;
+	streamTileSize = header.streamTileSize;
+	SetParams(header.params);
+
+	bedrock = std::move(layers[0]);
+	sediments = std::move(layers[1]);
+	vegetation = std::move(layers[2]);
+	ReleaseTerrainStore();
+	shadows = ScalarField2D();
+	windField.clear();
+	distributedThreads = 0;
+
+	threadData.clear();
+	ResetThreadData(1);
+	bedrockDirtyBits.clear();
+	for (int k = 0; k + 1 < dirty.size(); k += 2)
+		threadData[0].bedrockDirty.push_back(Vector2i(dirty[k], dirty[k + 1]));
+	bedrockDirtyAll = header.bedrockDirtyAll != 0;
+	if (validationOn)
+		ResetMassReport();
+}
+
+/*!
+\brief Bilinear interpolation of a field at given grid coordinates, clamped to the field.
+\param field field
+\param x, y grid coordinates
+*/
+static float ResampleBilinear(const ScalarField2D& field, float x, float y)
+{
+	const int i = Math::Clamp(int(x), 0, Math::Max(field.SizeX() - 2, 0));
+	const int j = Math::Clamp(int(y), 0, Math::Max(field.SizeY() - 2, 0));
+	const int i1 = Math::Min(i + 1, field.SizeX() - 1);
+	const int j1 = Math::Min(j + 1, field.SizeY() - 1);
+	const float u = Math::Clamp(x - float(i));
+	const float v = Math::Clamp(y - float(j));
+	return (1 - u) * (1 - v) * field.Get(i, j) + u * (1 - v) * field.Get(i1, j)
+		+ (1 - u) * v * field.Get(i, j1) + u * v * field.Get(i1, j1);
+}
+
+/*!
+\brief Resample the simulation to another resolution over the same domain, so that a run can start on a
+coarse grid and finish on a fine one. Layers are interpolated bilinearly. The wind, the amounts moved by an
+event and the distances are scaled with the cell size, so that hops, shadows and slopes span the same number
+of cells; thresholds on the terrain are kept. Caches are rebuilt at the next step, and the layers are no
+longer mapped.
+\param resX, resY new grid resolution
+*/
+void DuneSediment::Resample(int resX, int resY)
+{
+	const float scaleX = float(nx - 1) / float(resX - 1);
+	const float scaleY = float(ny - 1) / float(resY - 1);
+	ScalarField2D layers[3] = { ScalarField2D(resX, resY, box), ScalarField2D(resX, resY, box), ScalarField2D(resX, resY, box) };
+#pragma omp parallel for num_threads(ThreadCount())
+	for (int j = 0; j < resY; j++)
+	{
+		for (int i = 0; i < resX; i++)
+		{
+			layers[0].Set(i, j, ResampleBilinear(bedrock, float(i) * scaleX, float(j) * scaleY));
+			layers[1].Set(i, j, ResampleBilinear(sediments, float(i) * scaleX, float(j) * scaleY));
+			layers[2].Set(i, j, ResampleBilinear(vegetation, float(i) * scaleX, float(j) * scaleY));
+		}
+	}
+
+	const float scale = (box.Size().x / (resX - 1)) / cellSize;
+	SimulationParams p = params;
+	p.matterToMove *= scale;
+	p.abrasionEpsilon *= scale;
+	p.shadowRadius *= scale;
+	p.reptationRadius *= scale;
+	SetParams(p);
+	wind = scale * wind;
+
+	nx = resX;
+	ny = resY;
+	cellSize = box.Size().x / (nx - 1);
+	bedrock = std::move(layers[0]);
+	sediments = std::move(layers[1]);
+	vegetation = std::move(layers[2]);
+	BuildTerrainStore();
+	shadows = ScalarField2D();
+	windField.clear();
+	distributedThreads = 0;
+
+	threadData.clear();
+	ResetThreadData(1);
+	bedrockDirtyBits.clear();
+	bedrockDirtyAll = true;
+	if (validationOn)
+		ResetMassReport();
+}
+
+/*!
+\brief Read and check a snapshot header. Returns false unless the magic, the version and the memory layout
+match, the grid has cells of positive size, and the layers and the dirty list lie in order within the file.
+\param in snapshot file
+\param header snapshot header
+*/
+static bool ReadSnapshotHeader(std::ifstream& in, SnapshotHeader& header)
+{
+	in.seekg(0, std::ios::end);
+	const uint64_t fileSize = uint64_t(in.tellg());
+	in.seekg(0, std::ios::beg);
+	if (fileSize < sizeof(header) || !in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+		return false;
+	if (memcmp(header.magic, "DUNESNAP", 8) != 0 || header.version != 1 || header.layout != SCALAR_FIELD_TILED)
+		return false;
+
+	// Grid, with cells of positive size
+	if (header.nx < 2 || header.ny < 2 || header.stepCount < 0)
+		return false;
+	if (!(header.box[2] > header.box[0]) || !(header.box[3] > header.box[1]) || !(header.box[2] - header.box[0] < INFINITY))
+		return false;
+	const uint64_t storage = ScalarField2D::StorageSize(header.nx, header.ny);
+	if (storage != header.storage || storage > uint64_t(INT_MAX))
+		return false;
+
+	// Layers in order, without overlap, before the dirty list which ends the file
+	const uint64_t layerSize = storage * sizeof(float);
+	uint64_t offset = sizeof(SnapshotHeader);
+	for (int l = 0; l < 3; l++)
+	{
+		if (header.layerOffset[l] < offset || header.layerOffset[l] % snapshotAlignment != 0)
+			return false;
+		offset = header.layerOffset[l] + layerSize;
+	}
+	if (header.dirtyOffset < offset || header.dirtyOffset > fileSize || header.dirtyCount > (fileSize - header.dirtyOffset) / (2 * sizeof(int32_t)))
+		return false;
+	return header.relaxationIterations >= 0 && header.batchSize >= 0 && header.streamTileSize >= 0;
+}
+
+/*!
+\brief Read the pending bedrock modifications of a snapshot.
+\param in snapshot file
+\param header snapshot header
+\param dirty cells, as pairs of coordinates
+*/
+static bool ReadSnapshotDirty(std::ifstream& in, const SnapshotHeader& header, std::vector<int32_t>& dirty)
+{
+	dirty.resize(2 * header.dirtyCount);
+	in.seekg(std::streamoff(header.dirtyOffset));
+	if (!dirty.empty() && !in.read(reinterpret_cast<char*>(dirty.data()), std::streamsize(dirty.size() * sizeof(int32_t))))
+		return false;
+	for (int k = 0; k + 1 < dirty.size(); k += 2)
+	{
+		if (dirty[k] < 0 || dirty[k] >= header.nx || dirty[k + 1] < 0 || dirty[k + 1] >= header.ny)
+			return false;
+	}
+	return true;
+}
+
+/*!
+\brief Save the state of the simulation in a binary snapshot, from which LoadSnapshot() restores the run.
+Random streams are derived from the seed and the step count, so they do not need to be saved. Caches and
+the thread count are not saved. Should be called between two steps. Saving to the snapshot the layers are
+mapped from amounts to SyncSnapshot().
+\param url file path
+*/
+bool DuneSediment::SaveSnapshot(const std::string& url) const
+{
+	if (SnapshotFile() != nullptr && SnapshotFile()->Url() == url)
+		return SyncSnapshot();
+
+	SnapshotHeader header;
+	std::vector<int32_t> dirty;
+	SnapshotState(header, dirty);
+
+	const uint64_t layerSize = header.storage * sizeof(float);
+	uint64_t offset = sizeof(SnapshotHeader);
+	for (int l = 0; l < 3; l++)
+	{
+		header.layerOffset[l] = SnapshotAlign(offset);
+		offset = header.layerOffset[l] + layerSize;
+	}
+	header.dirtyOffset = offset;
+	header.dirtyCount = dirty.size() / 2;
+
+	std::ofstream out;
+	out.open(url, std::ios::binary | std::ios::trunc);
+	if (out.is_open() == false)
+		return false;
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	const ScalarField2D* layers[3] = { &bedrock, &sediments, &vegetation };
+	const std::vector<char> padding(snapshotAlignment, 0);
+	offset = sizeof(SnapshotHeader);
+	for (int l = 0; l < 3; l++)
+	{
+		out.write(padding.data(), std::streamsize(header.layerOffset[l] - offset));
+		out.write(reinterpret_cast<const char*>(layers[l]->Data()), std::streamsize(layerSize));
+		offset = header.layerOffset[l] + layerSize;
+	}
+	if (dirty.empty() == false)
+		out.write(reinterpret_cast<const char*>(dirty.data()), std::streamsize(dirty.size() * sizeof(int32_t)));
+	return out.good();
+}
+
+/*!
+\brief Restore the state of a simulation saved by SaveSnapshot(). The state is left unchanged if the file
+cannot be read, or was saved with another memory layout.
+\param url file path
+*/
+bool DuneSediment::LoadSnapshot(const std::string& url)
+{
+	std::ifstream in;
+	in.open(url, std::ios::binary);
+	if (in.is_open() == false)
+		return false;
+	SnapshotHeader header;
+	if (!ReadSnapshotHeader(in, header))
+		return false;
+
+	// Layers
+	const Box2D b = Box2D(Vector2(header.box[0], header.box[1]), Vector2(header.box[2], header.box[3]));
+	ScalarField2D layers[3];
+	for (int l = 0; l < 3; l++)
+	{
+		layers[l] = ScalarField2D(header.nx, header.ny, b);
+		if (uint64_t(layers[l].Storage()) != header.storage)
+			return false;
+		in.seekg(std::streamoff(header.layerOffset[l]));
+		if (!in.read(reinterpret_cast<char*>(layers[l].Data()), std::streamsize(header.storage * sizeof(float))))
+			return false;
+	}
+	std::vector<int32_t> dirty;
+	if (!ReadSnapshotDirty(in, header, dirty))
+		return false;
+
+	RestoreSnapshotState(header, layers, dirty);
+	return true;
+}
+
+/*!
+\brief Restore the state of a simulation saved by SaveSnapshot(), the bedrock, sediment and vegetation layers
+being mapped from the file rather than read. The simulation then modifies the file in place, pages being
+loaded and written back on demand, so that the layers may exceed the physical memory. Call SyncSnapshot()
+to make the file a consistent checkpoint. The state is left unchanged if the file cannot be mapped.
+Copies of the simulation are not mapped, see SnapshotFile().
+Only the layers are mapped: the steps of the other schedulers build the terrain store, cached heights or
+interleaved cells, as well as the wind and shadow caches when they are on, on the heap for the whole grid.
+A grid larger than the physical memory must therefore be simulated with the streamed steps, see
+SetStreamingMode(), which only allocate the windows of the tiles.
+\param url file path
+*/
+bool DuneSediment::MapSnapshot(const std::string& url)
+{
+	std::ifstream in;
+	in.open(url, std::ios::binary);
+	if (in.is_open() == false)
+		return false;
+	SnapshotHeader header;
+	if (!ReadSnapshotHeader(in, header))
+		return false;
+	std::vector<int32_t> dirty;
+	if (!ReadSnapshotDirty(in, header, dirty))
+		return false;
+	in.close();
+
+	// Header and layers are mapped, the dirty list is read and written separately as its size changes
+	std::shared_ptr<FileMapping> file = std::make_shared<FileMapping>();
+	if (!file->Open(url, size_t(header.dirtyOffset)))
+		return false;
+	const Box2D b = Box2D(Vector2(header.box[0], header.box[1]), Vector2(header.box[2], header.box[3]));
+	ScalarField2D layers[3];
+	for (int l = 0; l < 3; l++)
+	{
+		layers[l] = ScalarField2D(header.nx, header.ny, b, file, size_t(header.layerOffset[l]));
+		if (uint64_t(layers[l].Storage()) != header.storage || header.layerOffset[l] + header.storage * sizeof(float) > header.dirtyOffset)
+			return false;
+	}
+
+	RestoreSnapshotState(header, layers, dirty);
+	return true;
+}
+
+/*!
+\brief Update the snapshot the layers are mapped from with the current state of the simulation, and wait
+until the file is written. Should be called between two steps.
+*/
+bool DuneSediment::SyncSnapshot() const
+{
+	const std::shared_ptr<FileMapping>& file = SnapshotFile();
+	if (file == nullptr)
+		return false;
+
+	SnapshotHeader* mapped = reinterpret_cast<SnapshotHeader*>(file->Address());
+	SnapshotHeader header;
+	std::vector<int32_t> dirty;
+	SnapshotState(header, dirty);
+	memcpy(header.layerOffset, mapped->layerOffset, sizeof(header.layerOffset));
+	header.dirtyOffset = mapped->dirtyOffset;
+	header.dirtyCount = dirty.size() / 2;
+
+	// Dirty list after the mapped range, then the header once the list is written
+	std::fstream out;
+	out.open(file->Url(), std::ios::binary | std::ios::in | std::ios::out);
+	if (out.is_open() == false)
+		return false;
+	out.seekp(std::streamoff(header.dirtyOffset));
+	if (dirty.empty() == false)
+		out.write(reinterpret_cast<const char*>(dirty.data()), std::streamsize(dirty.size() * sizeof(int32_t)));
+	out.close();
+	if (out.fail())
+		return false;
+	*mapped = header;
+	return file->Flush();
+}
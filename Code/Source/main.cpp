@@ -20,7 +20,7 @@ int main()
 	// Transverse dunes are created under unimodal wind, as well as medium to high sand supply.
 	// They are basically the default dune type obtained by any basic simulation scenario.
 	std::cout << "Transverse dunes" << std::endl;
-	DuneSediment dune = DuneSediment(Box2D(Vector2(0), Vector2(256)), 3.0, 5.0, Vector2(3, 0));
+	DuneSediment dune = DuneSediment(Box2D(Vector2(0), Vector2(256)), 3.0, 5.0, Vector2(0, 3));
 	for (int i = 0; i < 300; i++)
 		dune.SimulationStepMultiThreadAtomic();
 	dune.ExportJPG("transverse.jpg");
@@ -28,7 +28,7 @@ int main()
 
 	// Barchan dunes appears under similar wind conditions, but lower sand supply.
 	std::cout << "Barchan dunes" << std::endl;
-	dune = DuneSediment(Box2D(Vector2(0), Vector2(256)), 0.5, 2.0, Vector2(5, 0));
+	dune = DuneSediment(Box2D(Vector2(0), Vector2(256)), 0.5, 2.0, Vector2(0, 5));
 	for (int i = 0; i < 300; i++)
 		dune.SimulationStepMultiThreadAtomic();
 	dune.ExportJPG("barchan.jpg");
@@ -37,7 +37,7 @@ int main()
 	// Yardangs are created by abrasion, activated with a specific flag in our simulation.
 	// Note: for more rounded yardangs, a turbulent wind is neccesary.
 	std::cout << "Yardangs" << std::endl;
-	dune = DuneSediment(Box2D(Vector2(0), Vector2(256)), 0.5, 0.5, Vector2(6, 0));
+	dune = DuneSediment(Box2D(Vector2(0), Vector2(256)), 0.5, 0.5, Vector2(0, 6));
 	dune.SetAbrasionMode(true);
 	for (int i = 0; i < 600; i++)
 		dune.SimulationStepMultiThreadAtomic();
@@ -46,7 +46,7 @@ int main()
 
 	// Nabkha are created under the influence of vegetation, also a flag to turn on.
 	std::cout << "Nabkha" << std::endl;
-	dune = DuneSediment(Box2D(Vector2(0), Vector2(256)), 2.0, 5.0, Vector2(3, 0));
+	dune = DuneSediment(Box2D(Vector2(0), Vector2(256)), 2.0, 5.0, Vector2(0, 3));
 	dune.SetVegetationMode(true);
 	for (int i = 0; i < 300; i++)
 		dune.SimulationStepMultiThreadAtomic();
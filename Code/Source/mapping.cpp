@@ -0,0 +1,129 @@
+#include "basics.h"
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*!
+\brief Default constructor, the mapping is closed.
+*/
+FileMapping::FileMapping() : address(nullptr), length(0)
+{
+#if defined(_WIN32)
+	file = INVALID_HANDLE_VALUE;
+	mapping = nullptr;
+#else
+	file = -1;
+#endif
+}
+
+/*!
+\brief Destructor, modified pages are written back by the system after the mapping is closed.
+*/
+FileMapping::~FileMapping()
+{
+	Close();
+}
+
+/*!
+\brief Map the beginning of an existing file in read-write mode. Any previous mapping is closed first.
+Returns false if the file cannot be opened or is shorter than the requested length.
+\param url file path
+\param length mapped length in bytes
+*/
+bool FileMapping::Open(const std::string& url, size_t length)
+{
+	Close();
+	if (length == 0)
+		return false;
+#if defined(_WIN32)
+	file = CreateFileA(url.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || uint64_t(size.QuadPart) < uint64_t(length))
+	{
+		Close();
+		return false;
+	}
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+	if (mapping == nullptr)
+	{
+		Close();
+		return false;
+	}
+	address = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, length));
+	if (address == nullptr)
+	{
+		Close();
+		return false;
+	}
+#else
+	file = open(url.c_str(), O_RDWR);
+	if (file < 0)
+		return false;
+	struct stat status;
+	if (fstat(file, &status) != 0 || uint64_t(status.st_size) < uint64_t(length))
+	{
+		Close();
+		return false;
+	}
+	void* view = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	if (view == MAP_FAILED)
+	{
+		Close();
+		return false;
+	}
+	address = static_cast<char*>(view);
+#endif
+	this->url = url;
+	this->length = length;
+	return true;
+}
+
+/*!
+\brief Unmap the file and close it.
+*/
+void FileMapping::Close()
+{
+#if defined(_WIN32)
+	if (address != nullptr)
+		UnmapViewOfFile(address);
+	if (mapping != nullptr)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if (address != nullptr)
+		munmap(address, length);
+	if (file >= 0)
+		close(file);
+	file = -1;
+#endif
+	address = nullptr;
+	length = 0;
+	url.clear();
+}
+
+/*!
+\brief Write the modified pages back to the file, and wait for completion.
+*/
+bool FileMapping::Flush()
+{
+	if (address == nullptr)
+		return false;
+#if defined(_WIN32)
+	return FlushViewOfFile(address, 0) && FlushFileBuffers(file);
+#else
+	return msync(address, length, MS_SYNC) == 0;
+#endif
+}
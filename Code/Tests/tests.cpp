@@ -0,0 +1,283 @@
+/*
+	Tests of the simulation. Every test prints its name and its result, and the program returns the number
+	of failed tests.
+
+	Usage: Tests
+*/
+
+#include "desert.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+/*!
+\brief Check that two simulations have exactly the same bedrock and sediment layers.
+\param a, b simulations
+\param nx, ny grid resolution
+*/
+static bool SameLayers(const DuneSediment& a, const DuneSediment& b, int nx, int ny)
+{
+	for (int j = 0; j < ny; j++)
+	{
+		for (int i = 0; i < nx; i++)
+		{
+			if (a.Bedrock(i, j) != b.Bedrock(i, j) || a.Sediment(i, j) != b.Sediment(i, j))
+			{
+				printf("    cell (%d, %d) differs\n", i, j);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/*!
+\brief The deterministic mode gives the same result for any number of threads. Abrasion is on, so that the
+bedrock stabilization sorts cells of equal bedrock.
+*/
+static bool TestDeterministicThreads()
+{
+	const int n = 256;
+	DuneSediment single(Box2D(Vector2(0), Vector2(float(n))), n, n, 0.5, 0.5, Vector2(0, 6), 7);
+	DuneSediment multi(Box2D(Vector2(0), Vector2(float(n))), n, n, 0.5, 0.5, Vector2(0, 6), 7);
+	single.SetDeterministicMode(true);
+	multi.SetDeterministicMode(true);
+	single.SetAbrasionMode(true);
+	multi.SetAbrasionMode(true);
+	single.SetThreadCount(1);
+	multi.SetThreadCount(4);
+	for (int s = 0; s < 20; s++)
+	{
+		single.SimulationStepMultiThreadAtomic();
+		multi.SimulationStepMultiThreadAtomic();
+	}
+	return SameLayers(single, multi, n, n);
+}
+
+/*!
+\brief Cached heights match the bedrock and sediment layers after every step of the atomic scheduler, with
+many threads updating the same cells of a small grid.
+*/
+static bool TestAtomicHeights()
+{
+	const int n = 64;
+	DuneSediment dune(Box2D(Vector2(0), Vector2(float(n))), n, n, 3.0, 5.0, Vector2(0, 3), 11);
+	dune.SetThreadCount(8);
+	for (int s = 0; s < 50; s++)
+	{
+		dune.SimulationStepMultiThreadAtomic();
+		for (int j = 0; j < n; j++)
+		{
+			for (int i = 0; i < n; i++)
+			{
+				if (dune.Height(i, j) != dune.Bedrock(i, j) + dune.Sediment(i, j))
+				{
+					printf("    step %d, cell (%d, %d): stale cached height\n", s, i, j);
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+/*!
+\brief Write a file.
+\param url file path
+\param bytes content
+*/
+static void WriteFile(const char* url, const std::vector<char>& bytes)
+{
+	std::ofstream out(url, std::ios::binary | std::ios::trunc);
+	out.write(bytes.data(), std::streamsize(bytes.size()));
+}
+
+/*!
+\brief Snapshots are restored exactly, and truncated or corrupted files are rejected without changing the
+simulation.
+*/
+static bool TestSnapshotValidation()
+{
+	const int n = 64;
+	const char* url = "test-snapshot.bin";
+	const char* bad = "test-snapshot-bad.bin";
+	DuneSediment dune(Box2D(Vector2(0), Vector2(float(n))), n, n, 3.0, 5.0, Vector2(0, 3), 5);
+	for (int s = 0; s < 3; s++)
+		dune.SimulationStepMultiThreadAtomic();
+	if (!dune.SaveSnapshot(url))
+		return false;
+	std::ifstream in(url, std::ios::binary);
+	const std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	in.close();
+
+	DuneSediment other(Box2D(Vector2(0), Vector2(float(n))), n, n, 1.0, 2.0, Vector2(0, 3), 6);
+	const DuneSediment reference = other;
+	bool ok = true;
+
+	// Truncated file, foreign magic, resolution not matching the layers, empty domain
+	std::vector<char> corrupted(bytes.begin(), bytes.begin() + bytes.size() / 2);
+	WriteFile(bad, corrupted);
+	ok = ok && !other.LoadSnapshot(bad) && !other.MapSnapshot(bad);
+	corrupted = bytes;
+	corrupted[0] = 'X';
+	WriteFile(bad, corrupted);
+	ok = ok && !other.LoadSnapshot(bad) && !other.MapSnapshot(bad);
+	corrupted = bytes;
+	const int32_t nx = 4 * n;
+	memcpy(corrupted.data() + 16, &nx, sizeof(nx));
+	WriteFile(bad, corrupted);
+	ok = ok && !other.LoadSnapshot(bad) && !other.MapSnapshot(bad);
+	corrupted = bytes;
+	float box[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	memcpy(corrupted.data() + 32, box, sizeof(box));
+	WriteFile(bad, corrupted);
+	ok = ok && !other.LoadSnapshot(bad) && !other.MapSnapshot(bad);
+	ok = ok && SameLayers(other, reference, n, n);
+
+	// Valid snapshot
+	ok = ok && other.LoadSnapshot(url) && SameLayers(other, dune, n, n);
+	remove(url);
+	remove(bad);
+	return ok;
+}
+
+/*!
+\brief A mapped snapshot is simulated in place. Copies of the mapped simulation are held on the heap and do not
+write to the snapshot, moved simulations keep the mapping.
+*/
+static bool TestMappedSnapshotOwnership()
+{
+	const int n = 64;
+	const char* url = "test-mapped.bin";
+	DuneSediment dune(Box2D(Vector2(0), Vector2(float(n))), n, n, 3.0, 5.0, Vector2(0, 3), 9);
+	if (!dune.SaveSnapshot(url))
+		return false;
+	DuneSediment mapped;
+	bool ok = mapped.MapSnapshot(url) && mapped.SnapshotFile() != nullptr && SameLayers(mapped, dune, n, n);
+	for (int j = 0; ok && j < n; j++)
+	{
+		for (int i = 0; i < n; i++)
+			ok = ok && mapped.Height(i, j) == mapped.Bedrock(i, j) + mapped.Sediment(i, j);
+	}
+
+	// Copies are in memory, and do not change the snapshot
+	DuneSediment copy = mapped;
+	ok = ok && copy.SnapshotFile() == nullptr && !copy.SyncSnapshot();
+	copy.SimulationStepMultiThreadAtomic();
+	ok = ok && SameLayers(mapped, dune, n, n);
+
+	// Moves keep the mapping, and steps write to the snapshot. Steps are deterministic so that both simulations
+	// can be compared with several threads.
+	DuneSediment moved = std::move(mapped);
+	ok = ok && moved.SnapshotFile() != nullptr;
+	dune.SetDeterministicMode(true);
+	moved.SetDeterministicMode(true);
+	dune.SimulationStepMultiThreadAtomic();
+	moved.SimulationStepMultiThreadAtomic();
+	ok = ok && SameLayers(moved, dune, n, n) && moved.SyncSnapshot();
+	DuneSediment reloaded;
+	ok = ok && reloaded.LoadSnapshot(url) && SameLayers(reloaded, dune, n, n);
+	moved = DuneSediment();
+	remove(url);
+	return ok;
+}
+
+/*!
+\brief Streamed steps, with the relaxation and bedrock stabilization passes performed by the tiles, give the same
+result for any number of threads and keep the mass of sand.
+*/
+static bool TestStreamedThreads()
+{
+	const int n = 256;
+	DuneSediment single(Box2D(Vector2(0), Vector2(float(n))), n, n, 0.5, 2.0, Vector2(0, 5), 3);
+	single.SetAbrasionMode(true);
+	single.SetRelaxationMode(2, 4);
+	single.SetStreamingMode(64);
+	DuneSediment multi = single;
+	single.SetThreadCount(1);
+	multi.SetThreadCount(3);
+	multi.SetValidationMode(true);
+	for (int s = 0; s < 10; s++)
+	{
+		single.SimulationStepMultiThreadAtomic();
+		multi.SimulationStepMultiThreadAtomic();
+	}
+	const MassReport& r = multi.LastMassReport();
+	return SameLayers(single, multi, n, n) && fabs(r.sedimentDrift) < 0.01 && fabs(r.bedrockDrift) < 0.01;
+}
+
+/*!
+\brief Volume of sand of a simulation, in cubic meter: the mean thickness of sand at the grid vertices times
+the area of the domain.
+\param dune simulation
+*/
+static double SedimentVolume(const DuneSediment& dune)
+{
+	double sum = 0.0;
+	for (int j = 0; j < dune.SizeY(); j++)
+	{
+		for (int i = 0; i < dune.SizeX(); i++)
+			sum += dune.Sediment(i, j);
+	}
+	const double sizeX = double(dune.SizeX() - 1) * dune.CellSize();
+	const double sizeY = double(dune.SizeY() - 1) * dune.CellSize();
+	return sum / (double(dune.SizeX()) * double(dune.SizeY())) * sizeX * sizeY;
+}
+
+/*!
+\brief Resampling scales the parameters with the cell size, so that resampling back to the initial resolution
+restores them, and keeps the volume of sand.
+*/
+static bool TestResample()
+{
+	const int n = 65;
+	DuneSediment dune(Box2D(Vector2(0), Vector2(float(n - 1))), n, n, 3.0, 5.0, Vector2(0, 3), 13);
+	for (int s = 0; s < 5; s++)
+		dune.SimulationStepMultiThreadAtomic();
+	const SimulationParams params = dune.Params();
+	const double volume = SedimentVolume(dune);
+	bool ok = true;
+
+	dune.Resample(2 * n - 1, 2 * n - 1);
+	ok = ok && fabs(dune.Params().matterToMove - 0.5f * params.matterToMove) < 1e-6f * params.matterToMove;
+	ok = ok && fabs(SedimentVolume(dune) - volume) < 0.005 * volume;
+	dune.SimulationStepMultiThreadAtomic();
+
+	dune.Resample(n, n);
+	ok = ok && dune.SizeX() == n && dune.SizeY() == n;
+	ok = ok && fabs(dune.Params().matterToMove - params.matterToMove) < 1e-6f * params.matterToMove;
+	ok = ok && fabs(dune.Params().shadowRadius - params.shadowRadius) < 1e-6f * params.shadowRadius;
+	ok = ok && fabs(SedimentVolume(dune) - volume) < 0.005 * volume;
+	return ok;
+}
+
+// Test of the suite.
+struct Test
+{
+	const char* name;	//!< Name.
+	bool (*run)();		//!< Test function, returns true on success.
+};
+
+static const Test tests[] =
+{
+	{ "deterministic mode does not depend on the thread count", TestDeterministicThreads },
+	{ "cached heights are up to date after atomic steps", TestAtomicHeights },
+	{ "snapshots are validated before they are restored", TestSnapshotValidation },
+	{ "copies of a mapped simulation are not mapped", TestMappedSnapshotOwnership },
+	{ "streamed mode does not depend on the thread count", TestStreamedThreads },
+	{ "resampling keeps the parameters and the volume of sand", TestResample },
+};
+
+int main()
+{
+	int failed = 0;
+	for (const Test& test : tests)
+	{
+		const bool ok = test.run();
+		printf("%s: %s\n", ok ? "PASS" : "FAIL", test.name);
+		failed += ok ? 0 : 1;
+	}
+	return failed;
+}
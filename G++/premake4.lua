@@ -14,6 +14,7 @@ solution "Desertscape"
 	configuration "linux"
 		buildoptions { "-mtune=native -march=native" }
 		buildoptions { "-std=c++14" }
+		buildoptions { "-fopenmp" }
 		buildoptions { "-w" }
 		buildoptions { "-flto -g"}
 		linkoptions { "-fopenmp" }
@@ -27,3 +28,31 @@ project("Desertscape")
 	kind "ConsoleApp"
 	targetdir "Out"
 files ( fileList )
+
+project("Benchmark")
+	language "C++"
+	kind "ConsoleApp"
+	targetdir "Out"
+	objdir "obj/Benchmark"
+files ( fileList )
+files { rootDir .. "/Code/Benchmark/*.cpp" }
+excludes { rootDir .. "/Code/Source/main.cpp" }
+
+project("BenchmarkProfile")
+	language "C++"
+	kind "ConsoleApp"
+	targetdir "Out"
+	objdir "obj/BenchmarkProfile"
+	defines { "DUNE_PROFILE=1" }
+files ( fileList )
+files { rootDir .. "/Code/Benchmark/*.cpp" }
+excludes { rootDir .. "/Code/Source/main.cpp" }
+
+project("Tests")
+	language "C++"
+	kind "ConsoleApp"
+	targetdir "Out"
+	objdir "obj/Tests"
+files ( fileList )
+files { rootDir .. "/Code/Tests/*.cpp" }
+excludes { rootDir .. "/Code/Source/main.cpp" }